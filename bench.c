@@ -0,0 +1,312 @@
+/*
+ * bench - an HTTP load generator for measuring the proxy against tiny
+ *
+ *   usage: bench [-c conns] [-d seconds] [-r rate] [-s zipf] [-k]
+ *                [-x proxyhost:port] host:port [path ...]
+ *
+ * Each of the conns threads keeps one connection busy for the given number
+ * of seconds, asking for the paths (tiny's files by default) with a Zipf
+ * distributed popularity, the first path being the most popular.
+ *
+ * Without -r the load is closed-loop: a thread sends its next request as
+ * soon as the last one is answered. With -r the load is open-loop at rate
+ * requests per second in total, each request having a scheduled start, and
+ * latency is measured from that start so that a stalled server isn't
+ * flattered by the requests it held back (coordinated omission).
+ *
+ * -k asks for keep-alive connections, servers that close them anyway are
+ * reconnected to. -x sends the requests through a proxy.
+ *
+ * bench.sh runs the same load against tiny directly and through the proxy.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "phist.h"
+
+#define MAX_PATHS 64
+#define MAX_CONNS 1024
+#define DEFAULT_CONNS 16
+#define DEFAULT_SECONDS 10
+#define DEFAULT_ZIPF 1.0
+#define MAX_NAME 1024
+
+typedef struct worker
+{
+    pthread_t tid;
+    int id;
+    uint64_t seed;
+    hist latency;                       // microseconds
+    long requests;
+    long errors;
+    long bytes;
+    long connects;
+} worker;
+
+static const char *default_paths[] = {"/home.html", "/csapp.c", "/tiny.c",
+                                      "/godzilla.gif", "/godzilla.jpg"};
+
+static char target_host[MAXLINE];       // where connections go
+static int target_port;
+static char origin[MAX_NAME];           // host:port named in the requests
+static int via_proxy = 0;
+static int keep_alive = 0;
+static int conns = DEFAULT_CONNS;
+static double rate = 0;
+static const char *paths[MAX_PATHS];
+static double cdf[MAX_PATHS];
+static int path_count = 0;
+static uint64_t end_time;
+
+static uint64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t when){
+    uint64_t now = now_us();
+    struct timespec ts;
+
+    if(when <= now) return;
+    ts.tv_sec = (when - now) / 1000000;
+    ts.tv_nsec = (when - now) % 1000000 * 1000;
+    nanosleep(&ts, NULL);
+    return;
+}
+
+// xorshift64*, one state per thread
+static uint64_t next_random(uint64_t *state){
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// the cumulative Zipf distribution over the paths, rank i weighs 1/i^s
+static void zipf_init(double s){
+    double total = 0;
+    int i;
+
+    for(i = 0; i < path_count; i++){
+        total += 1.0 / pow(i + 1, s);
+        cdf[i] = total;
+    }
+    for(i = 0; i < path_count; i++) cdf[i] /= total;
+    return;
+}
+
+static const char *pick_path(uint64_t *state){
+    double u = (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0;
+    int hi = path_count - 1;
+    int mid;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return paths[lo];
+}
+
+// sends one request and reads the whole response, returns the number of
+// body bytes or -1 on an error, clears keep if the server will close
+static long do_request(int fd, rio_t *rio, const char *path, int *keep){
+    char buf[MAXLINE];
+    long length = -1;
+    long total = 0;
+    int close_after = !keep_alive;
+    int n;
+
+    if(via_proxy) n = sprintf(buf, "GET http://%s%s", origin, path);
+    else n = sprintf(buf, "GET %s", path);
+    n += sprintf(&buf[n], " HTTP/1.%d\r\nHost: %s\r\n%s\r\n",
+                 keep_alive, origin,
+                 keep_alive ? "Connection: keep-alive\r\n" : "");
+    if(rio_writen(fd, buf, n) != n) return -1;
+
+    if(rio_readlineb(rio, buf, MAXLINE) <= 0) return -1;
+    if(strncmp(buf, "HTTP/1.0", 8) == 0) close_after = 1;
+    if(strncmp(buf, "HTTP/1.", 7) != 0) return -1;
+
+    while((n = rio_readlineb(rio, buf, MAXLINE)) > 0){
+        if(buf[0] == '\r' || buf[0] == '\n') break;
+        if(strncasecmp(buf, "Content-Length:", 15) == 0){
+            length = atol(buf + 15);
+        }
+        else if(strncasecmp(buf, "Connection:", 11) == 0){
+            if(strcasestr(buf, "close")) close_after = 1;
+            if(strcasestr(buf, "keep-alive") && keep_alive) close_after = 0;
+        }
+    }
+    if(n <= 0) return -1;
+
+    // without a length the body runs until the server closes
+    if(length < 0) close_after = 1;
+    while(length != 0 &&
+          (n = rio_readnb(rio, buf, (length > 0 && length < MAXLINE) ?
+                                    length : MAXLINE)) > 0){
+        total += n;
+        if(length > 0) length -= n;
+    }
+    if(n < 0 || length > 0) return -1;
+
+    *keep = !close_after;
+    return total;
+}
+
+static void *run_worker(void *vargp){
+    worker *w = vargp;
+    uint64_t interval = 0;
+    uint64_t start;
+    uint64_t done;
+    long bytes;
+    int keep = 0;
+    int fd = -1;
+    rio_t rio;
+
+    // open-loop threads share the rate and start staggered
+    if(rate > 0) interval = (uint64_t)(conns * 1e6 / rate);
+    start = now_us() + (interval * w->id) / conns;
+
+    while((rate > 0 ? start : now_us()) < end_time){
+        if(rate > 0) sleep_until(start);
+        else start = now_us();
+
+        if(fd < 0){
+            if((fd = open_clientfd_r(target_host, target_port)) < 0){
+                w->errors++;
+                fd = -1;
+                usleep(1000);
+                start += interval;
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+            w->connects++;
+        }
+
+        bytes = do_request(fd, &rio, pick_path(&w->seed), &keep);
+        done = now_us();
+        if(bytes < 0){
+            w->errors++;
+            keep = 0;
+        }
+        else{
+            hist_record(&w->latency, done - start);
+            w->requests++;
+            w->bytes += bytes;
+        }
+        if(!keep){
+            close(fd);
+            fd = -1;
+        }
+        start += interval;
+    }
+    if(fd >= 0) close(fd);
+    return NULL;
+}
+
+static void usage(char *name){
+    fprintf(stderr, "usage: %s [-c conns] [-d seconds] [-r rate] [-s zipf] "
+            "[-k] [-x proxyhost:port] host:port [path ...]\n", name);
+    exit(1);
+}
+
+// splits host:port, returns 0 on success
+static int split_host(const char *name, char *host, int *port){
+    const char *colon = strrchr(name, ':');
+
+    if(colon == NULL || colon == name || strlen(name) >= MAX_NAME) return -1;
+    sprintf(host, "%.*s", (int)(colon - name), name);
+    *port = atoi(colon + 1);
+    return (*port > 0) ? 0 : -1;
+}
+
+int main(int argc, char **argv){
+    static worker workers[MAX_CONNS];
+    char *proxy = NULL;
+    char origin_host[MAXLINE];
+    int origin_port;
+    int seconds = DEFAULT_SECONDS;
+    double zipf = DEFAULT_ZIPF;
+    double elapsed;
+    uint64_t started;
+    hist all;
+    long requests = 0, errors = 0, bytes = 0, connects = 0;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "c:d:r:s:kx:")) != -1){
+        switch(opt){
+        case 'c': conns = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 's': zipf = atof(optarg); break;
+        case 'k': keep_alive = 1; break;
+        case 'x': proxy = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind >= argc || conns < 1 || conns > MAX_CONNS || seconds < 1 ||
+       rate < 0 || split_host(argv[optind], origin_host, &origin_port) < 0){
+        usage(argv[0]);
+    }
+    strcpy(origin, argv[optind]);
+
+    if(proxy != NULL){
+        if(split_host(proxy, target_host, &target_port) < 0) usage(argv[0]);
+        via_proxy = 1;
+    }
+    else{
+        strcpy(target_host, origin_host);
+        target_port = origin_port;
+    }
+
+    for(i = optind + 1; i < argc && path_count < MAX_PATHS; i++){
+        paths[path_count++] = argv[i];
+    }
+    if(path_count == 0){
+        for(i = 0; i < sizeof(default_paths) / sizeof(char *); i++){
+            paths[path_count++] = default_paths[i];
+        }
+    }
+    zipf_init(zipf);
+    Signal(SIGPIPE, SIG_IGN);
+
+    started = now_us();
+    end_time = started + seconds * 1000000ULL;
+    for(i = 0; i < conns; i++){
+        workers[i].id = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        hist_init(&workers[i].latency);
+        Pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+    }
+
+    hist_init(&all);
+    for(i = 0; i < conns; i++){
+        Pthread_join(workers[i].tid, NULL);
+        hist_merge(&all, &workers[i].latency);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        connects += workers[i].connects;
+    }
+    elapsed = (now_us() - started) / 1e6;
+
+    printf("%s%s%s, %d %s connections, %s, %.1fs\n", origin,
+           via_proxy ? " via " : "", via_proxy ? proxy : "", conns,
+           keep_alive ? "keep-alive" : "one-shot",
+           rate > 0 ? "open loop" : "closed loop", elapsed);
+    printf("requests    %ld (%ld errors, %ld connects)\n", requests, errors,
+           connects);
+    printf("throughput  %.1f req/s, %.2f MB/s\n", requests / elapsed,
+           bytes / elapsed / 1e6);
+    printf("latency us  mean %.0f  p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  "
+           "max %lu\n", hist_mean(&all),
+           (unsigned long)hist_percentile(&all, 50),
+           (unsigned long)hist_percentile(&all, 90),
+           (unsigned long)hist_percentile(&all, 99),
+           (unsigned long)hist_percentile(&all, 99.9),
+           (unsigned long)all.max);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# bench.sh - runs the same load against tiny directly, through the proxy,
+#     and through the proxy with its cache kept in a file (-f) so hits go
+#     out with sendfile, so the three can be compared
+#
+#     usage: ./bench.sh [bench options]
+#
+#     e.g. ./bench.sh -c 32 -d 10
+#          ./bench.sh -c 8 -r 2000 -k
+#
+
+PORT_START=20000
+MAX_RAND=40000
+
+#
+# free_port - returns a TCP port nothing is listening on
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+    while ss -ltn | awk '{print $4}' | grep -q ":${port}$"
+    do
+        port=`expr ${port} + 1`
+    done
+    echo "${port}"
+}
+
+#
+# wait_for_port_use - spins until something listens on the port
+#
+function wait_for_port_use {
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        ss -ltn | awk '{print $4}' | grep -q ":${1}$" && return
+        sleep 0.5
+    done
+    echo "Error: nothing listening on port ${1}"
+    exit 1
+}
+
+if [ ! -x ./bench ] || [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]
+then
+    echo "Error: build ./bench, ./proxy and ./tiny/tiny first."
+    exit 1
+fi
+
+tiny_port=$(free_port)
+(cd ./tiny; ./tiny ${tiny_port} &> /dev/null &)
+wait_for_port_use ${tiny_port}
+
+proxy_port=$(free_port)
+while [ ${proxy_port} -eq ${tiny_port} ]; do proxy_port=$(free_port); done
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use ${proxy_port}
+
+file_port=$(free_port)
+while [ ${file_port} -eq ${tiny_port} ] || [ ${file_port} -eq ${proxy_port} ]
+do
+    file_port=$(free_port)
+done
+./proxy -f ${file_port} &> /dev/null &
+file_pid=$!
+wait_for_port_use ${file_port}
+
+echo "*** Direct to tiny"
+./bench "$@" localhost:${tiny_port}
+echo ""
+echo "*** Through the proxy"
+./bench "$@" -x localhost:${proxy_port} localhost:${tiny_port}
+echo ""
+echo "*** Through the proxy, cache in a file"
+./bench "$@" -x localhost:${file_port} localhost:${tiny_port}
+
+kill ${proxy_pid} ${file_pid}
+pkill -f "tiny ${tiny_port}"
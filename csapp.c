@@ -1,4 +1,5 @@
 /* $begin csapp.c */
+#include <poll.h>
 #include "csapp.h"
 
 /* Updated with a reentrant open_clientfd_r function */
@@ -796,6 +797,60 @@ int open_clientfd_r(char *hostname, int port) {
     }
 }
 
+/*
+ * open_clientfd_t - open_clientfd_r that gives up on each address after
+ *     timeout milliseconds of waiting for the connect, so a server that
+ *     drops the SYN doesn't hold the caller for the kernel's retries
+ *     Returns -1 on failure, the socket is left blocking.
+ */
+int open_clientfd_t(char *hostname, int port, int timeout) {
+    int clientfd = -1;
+    int flags, err, rv;
+    socklen_t len;
+    struct addrinfo hints, *addlist, *p;
+    struct pollfd pfd;
+    char port_str[MAXLINE];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port_str, "%d", port);
+    if ((rv = getaddrinfo(hostname, port_str, &hints, &addlist)) != 0) {
+        return -1;
+    }
+
+    for (p = addlist; p; p = p->ai_next) {
+        if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) break;
+        flags = fcntl(clientfd, F_GETFL);
+        fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
+
+        err = 0;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) < 0) {
+            err = errno;
+            if (err == EINPROGRESS) {
+                pfd.fd = clientfd;
+                pfd.events = POLLOUT;
+                while ((rv = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+                len = sizeof(err);
+                if (rv != 1 ||
+                    getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err,
+                               &len) < 0) {
+                    err = ETIMEDOUT;
+                }
+            }
+        }
+        if (err == 0) { /* success */
+            fcntl(clientfd, F_SETFL, flags);
+            break;
+        }
+        close(clientfd);
+        clientfd = -1;
+    }
+
+    freeaddrinfo(addlist);
+    return clientfd;
+}
+
 /*  
  * open_listenfd - open and return a listening socket on port
  *     Returns -1 and sets errno on Unix error.
@@ -159,6 +159,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
+int open_clientfd_t(char *hostname, int portno, int timeout);
 int open_listenfd(int portno);
 
 /* Wrappers for client/server helper functions */
@@ -0,0 +1,224 @@
+#include <math.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "pstats.h"
+#include "padmit.h"
+
+static const char* busy =
+    "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 1\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+typedef struct waiting
+{
+    int fd;
+    uint64_t since;                     // when it was queued, in us
+} waiting;
+
+// the queue, a ring of ADMIT_QUEUE entries, and the threads taking from it
+static waiting queue[ADMIT_QUEUE];
+static int head = 0;
+static int count = 0;
+static int threads = 0;
+static int idle = 0;
+static int max_threads;
+static int queue_size = ADMIT_QUEUE;
+static void (*serve_fd)(int fd);
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+// CoDel's state, only touched with mutex held
+static uint64_t first_above = 0;        // when waits became too long for good
+static uint64_t drop_next = 0;          // when to shed next while shedding
+static int dropping = 0;
+static int drops = 0;                   // shed since shedding began
+
+static void* admit_thread(void* vargp);
+
+// answers a connection with a 503 without reading its request, the write
+// never blocks, if the socket can't take it the client just sees a close
+static void reject(int fd, enum stat_id why){
+    send(fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    stats_inc(STAT_CONNECTIONS_OPENED);
+    stats_inc(STAT_CONNECTIONS_CLOSED);
+    stats_inc(why);
+    return;
+}
+
+// starts another thread, called with mutex held, returns 0 on success
+// a failure leaves the connection queued for the threads already running
+static int add_thread(){
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, admit_thread, NULL) != 0) return -1;
+    threads++;
+    return 0;
+}
+
+// decides whether a connection that waited since when should be shed,
+// following CoDel's control law: once waits have stayed above the target
+// for an interval, shed one, then shed again after interval/sqrt(drops)
+// for as long as they stay above it
+// connections are slow to come off the queue when each takes long to
+// serve, so while shedding any that waited a whole interval go as well
+static int should_shed(uint64_t since, uint64_t now){
+    int above = 0;
+
+    if(dropping && now - since >= ADMIT_INTERVAL) return 1;
+
+    // a short wait, or an empty queue behind this connection, means the
+    // threads are keeping up
+    if(now - since < ADMIT_TARGET || count == 0){
+        first_above = 0;
+    }
+    else if(first_above == 0){
+        first_above = now + ADMIT_INTERVAL;
+    }
+    else if(now >= first_above){
+        above = 1;
+    }
+
+    if(dropping){
+        if(!above){
+            dropping = 0;
+            return 0;
+        }
+        if(now < drop_next) return 0;
+        drops++;
+        drop_next += ADMIT_INTERVAL / sqrt(drops);
+        return 1;
+    }
+    if(!above) return 0;
+
+    // coming back into shedding soon after leaving it picks up near the
+    // rate it left off at
+    dropping = 1;
+    drops = (drops > 2 && now - drop_next < 8 * ADMIT_INTERVAL) ?
+            drops - 2 : 1;
+    drop_next = now + ADMIT_INTERVAL / sqrt(drops);
+    return 1;
+}
+
+// takes the next connection worth serving off the queue, waiting for one
+static int take(){
+    waiting w;
+
+    pthread_mutex_lock(&mutex);
+    while(1){
+        idle++;
+        while(count == 0) pthread_cond_wait(&ready, &mutex);
+        idle--;
+
+        w = queue[head];
+        head = (head + 1) % queue_size;
+        count--;
+        if(!should_shed(w.since, stats_clock())) break;
+
+        pthread_mutex_unlock(&mutex);
+        reject(w.fd, STAT_CONNECTIONS_SHED);
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    return w.fd;
+}
+
+// the p_Rio wrappers end a thread that loses its connection, its place
+// goes to a new one if connections are still waiting
+static void thread_gone(void* vargp){
+    pthread_mutex_lock(&mutex);
+    threads--;
+    if(count > idle) add_thread();
+    pthread_mutex_unlock(&mutex);
+    return;
+}
+
+static void* admit_thread(void* vargp){
+    Pthread_detach(Pthread_self());
+    pthread_cleanup_push(thread_gone, NULL);
+    while(1) serve_fd(take());
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+int admit_init(int n, void (*serve)(int fd)){
+    struct rlimit limit;
+    long fds;
+    long reserve;
+
+    max_threads = n;
+    serve_fd = serve;
+
+    // two descriptors for each thread and one for each queued connection
+    // must fit, with at least a third of them left for the queue
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+       limit.rlim_cur != RLIM_INFINITY){
+        fds = limit.rlim_cur;
+        reserve = (fds / 4 < ADMIT_RESERVE_FDS) ? fds / 4 : ADMIT_RESERVE_FDS;
+        fds -= reserve;
+        if(max_threads > fds / 3) max_threads = fds / 3;
+        if(max_threads < 1) max_threads = 1;
+        if(queue_size > fds - 2 * max_threads){
+            queue_size = fds - 2 * max_threads;
+        }
+        if(queue_size < 1) queue_size = 1;
+    }
+    return max_threads;
+}
+
+int admit_accept(int listenfd){
+    struct sockaddr_in addr;
+    socklen_t len;
+    int fd;
+
+    while(1){
+        len = sizeof(addr);
+        if((fd = accept(listenfd, (SA*)&addr, &len)) >= 0) return fd;
+        if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+           errno == ENOMEM){
+            // the connection stays in the backlog until descriptors free up
+            stats_inc(STAT_CONNECTIONS_SHED);
+            usleep(ADMIT_BACKOFF);
+        }
+        else if(errno != EINTR && errno != ECONNABORTED &&
+                errno != EPROTO && errno != EPERM){
+            unix_error("Accept error");
+        }
+    }
+}
+
+void admit(int fd){
+    uint64_t now = stats_clock();
+
+    pthread_mutex_lock(&mutex);
+    if(count == queue_size){
+        pthread_mutex_unlock(&mutex);
+        reject(fd, STAT_CONNECTIONS_REJECTED);
+        return;
+    }
+
+    // while shedding, a connection that would queue behind one that has
+    // already waited too long is turned away at once, rather than after
+    // waiting just as long to be shed by a thread
+    if(dropping && count > 0 && now - queue[head].since >= ADMIT_TARGET){
+        pthread_mutex_unlock(&mutex);
+        reject(fd, STAT_CONNECTIONS_SHED);
+        return;
+    }
+    queue[(head + count) % queue_size].fd = fd;
+    queue[(head + count) % queue_size].since = now;
+    count++;
+
+    // more connections waiting than idle threads to take them
+    if(count > idle && threads < max_threads) add_thread();
+
+    // with no thread at all, not even one to start, nothing can be served
+    if(threads > 0){
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    count--;
+    pthread_mutex_unlock(&mutex);
+    reject(fd, STAT_CONNECTIONS_REJECTED);
+    return;
+}
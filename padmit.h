@@ -0,0 +1,44 @@
+#ifndef PADMIT_H_
+#define PADMIT_H_
+
+// admission control between the accept loop and the threads serving
+// connections: at most max_threads connections are served at once, the
+// rest wait in a queue, and rather than letting the queue turn into
+// minutes of delay, connections are turned away with a quick 503
+//  - outright, when the queue is full
+//  - CoDel style, when connections have waited longer than ADMIT_TARGET
+//    for a whole ADMIT_INTERVAL, shedding more often the longer it lasts
+
+// connections waiting for a thread, any more are rejected
+#define ADMIT_QUEUE 1024
+// descriptors kept back from connections for everything else (listening
+// sockets, the log, the cache file, peers), at most a quarter of the limit
+#define ADMIT_RESERVE_FDS 64
+// how long the accept loop pauses when out of descriptors, in microseconds
+#define ADMIT_BACKOFF 10000
+// default for the most connections served at once
+#define ADMIT_THREADS 256
+// acceptable time to wait for a thread, in microseconds
+#define ADMIT_TARGET 10000
+// how long waits may stay above ADMIT_TARGET before shedding starts, in
+// microseconds
+#define ADMIT_INTERVAL 100000
+
+// starts admitting connections, each served by serve(fd) on one of up to
+// max_threads threads, which are started as they are needed and kept
+// serve must close fd, a thread that exits while serving is replaced
+// the threads, each holding a client and a server descriptor, and the
+// queue are cut down to fit the process's descriptor limit, returns the
+// number of threads that may run
+int admit_init(int max_threads, void (*serve)(int fd));
+
+// accepts the next connection on listenfd, riding out aborted connections
+// and running out of descriptors, which count as shed and pause accepting
+// for ADMIT_BACKOFF, exits only on errors that make listenfd unusable
+int admit_accept(int listenfd);
+
+// queues an accepted connection for a thread, or rejects it right away if
+// the queue is full
+void admit(int fd);
+
+#endif
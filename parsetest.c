@@ -0,0 +1,275 @@
+/*
+ * parsetest - table driven checks of the proxy's request and response
+ *             parsers
+ *
+ *   usage: parsetest
+ *
+ * Runs each table through the function it is for and prints every case
+ * whose result isn't the expected one: the canonical URLs cache keys are
+ * built from (percent-encoding, query sorting and stripping, fragments),
+ * dot segment removal, chunked bodies (with extensions and trailers, fed
+ * in pieces of every size) and Range headers.
+ *
+ * Exits with 0 if every case passed and 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pkey.h"
+#include "phttp.h"
+
+#define MAX_BODY 256
+#define MAX_CASE_RANGES 4
+
+static int checks = 0;
+static int failures = 0;
+
+static void check(int ok, const char* table, const char* input,
+                  const char* got, const char* want){
+    checks++;
+    if(ok) return;
+    failures++;
+    printf("FAIL %s \"%s\": got \"%s\", want \"%s\"\n", table, input, got,
+           want);
+}
+
+
+// canonical URLs, under the query options in force for each case
+typedef struct url_case
+{
+    int sort_query;
+    const char* strip;
+    const char* host;
+    int port;
+    const char* path;
+    const char* want;
+} url_case;
+
+static const url_case url_cases[] = {
+    {0, NULL, "WWW.Example.COM.", 80, "/a", "www.example.com:80/a"},
+    {0, NULL, "h", 8080, "", "h:8080/"},
+    {0, NULL, "h", 80, "/%7e%41%2d", "h:80/~A-"},
+    {0, NULL, "h", 80, "/a%2fb%3a%2A", "h:80/a%2Fb%3A%2A"},
+    {0, NULL, "h", 80, "/a%4", "h:80/a%4"},
+    {0, NULL, "h", 80, "/a%zz", "h:80/a%zz"},
+    {0, NULL, "h", 80, "/x#frag", "h:80/x"},
+    {0, NULL, "h", 80, "/x?b=2#frag", "h:80/x?b=2"},
+    {0, NULL, "h", 80, "/a/b/../c/./d", "h:80/a/c/d"},
+    {0, NULL, "h", 80, "/q?b=2&a=1", "h:80/q?b=2&a=1"},
+    {1, NULL, "h", 80, "/q?b=2&a=1&c", "h:80/q?a=1&b=2&c"},
+    {1, NULL, "h", 80, "/q?a=%7e&a=%2f", "h:80/q?a=%2F&a=~"},
+    {0, "utm_source,fbclid", "h", 80, "/q?utm_source=x&a=1&fbclid=2",
+     "h:80/q?a=1"},
+    {0, "utm_source,fbclid", "h", 80, "/q?utm_source=x", "h:80/q"},
+    {0, "utm_source", "h", 80, "/q?utm_sourcex=1&utm=2",
+     "h:80/q?utm_sourcex=1&utm=2"},
+    {1, "utm_source", "h", 80, "/q?z&utm_source&a=1", "h:80/q?a=1&z"},
+};
+
+static void test_urls(){
+    char url[MAX_URL];
+    const url_case* c;
+    int i;
+
+    for(i = 0; i < sizeof(url_cases) / sizeof(url_cases[0]); i++){
+        c = &url_cases[i];
+        key_init(c->sort_query, c->strip);
+        if(key_url(url, MAX_URL, c->host, c->port, c->path) < 0){
+            strcpy(url, "(error)");
+        }
+        check(!strcmp(url, c->want), "key_url", c->path, url, c->want);
+    }
+    key_init(0, NULL);
+}
+
+
+// dot segment removal, mostly the examples of RFC 3986 5.2.4 and 5.4
+typedef struct dots_case
+{
+    const char* path;
+    const char* want;
+} dots_case;
+
+static const dots_case dots_cases[] = {
+    {"/a/b/c/./../../g", "/a/g"},
+    {"mid/content=5/../6", "mid/6"},
+    {"/a/b/c/../../../g", "/g"},
+    {"/a/b/../../../../g", "/g"},
+    {"/../a", "/a"},
+    {"../a", "a"},
+    {"./a", "a"},
+    {"/a/..", "/"},
+    {"/a/.", "/a/"},
+    {"/.", "/"},
+    {".", ""},
+    {"..", ""},
+    {"/a//../b", "/a/b"},
+    {"/a/.b/..c/...", "/a/.b/..c/..."},
+    {"/a/b", "/a/b"},
+};
+
+static void test_dots(){
+    char path[MAX_URL];
+    const dots_case* c;
+    int i;
+    int n;
+
+    for(i = 0; i < sizeof(dots_cases) / sizeof(dots_cases[0]); i++){
+        c = &dots_cases[i];
+        strcpy(path, c->path);
+        n = key_remove_dots(path, strlen(path));
+        check(n == strlen(path) && !strcmp(path, c->want),
+              "key_remove_dots", c->path, path, c->want);
+    }
+}
+
+
+// chunked bodies, want is the decoded body (NULL if the framing is
+// broken) and rest what follows the response on the connection
+typedef struct chunk_case
+{
+    const char* body;
+    const char* want;
+    const char* rest;
+} chunk_case;
+
+static const chunk_case chunk_cases[] = {
+    {"5\r\nhello\r\n0\r\n\r\n", "hello", ""},
+    {"5;x=y\r\nhello\r\nA\r\n0123456789\r\n0\r\n\r\nNEXT",
+     "hello0123456789", "NEXT"},
+    {"3;name=\"a;b\";n2\r\nabc\r\n0\r\n\r\n", "abc", ""},
+    {"3 ; ext\r\nabc\r\n0\r\n\r\n", "abc", ""},
+    {"00a\r\n0123456789\r\n0\r\n\r\n", "0123456789", ""},
+    {"1\r\nx\r\n0\r\nA: 1\r\nB: 2\r\n\r\nNEXT", "x", "NEXT"},
+    {"1\nx\n0\nA: 1\n\nNEXT", "x", "NEXT"},
+    {"0;last\r\nExpires: 0\r\n\r\n", "", ""},
+    {"zz\r\n", NULL, NULL},
+    {"\r\n", NULL, NULL},
+    {"5\r\nhelloX\r\n", NULL, NULL},
+    {"1\r\nx\r\n0\r\n\rX", NULL, NULL},
+    {"fffffffff\r\n", NULL, NULL},
+};
+
+// decodes body handed over step bytes at a time, as reads may split it,
+// returns 0 with the decoded body in out and what came after it in rest,
+// or -1 if the framing was found broken
+static int decode_in_steps(const char* body, int step, char* out,
+                           const char** rest){
+    static const char* head = "HTTP/1.1 200 OK\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n";
+    http_body b;
+    char buf[MAX_BODY];
+    int len = strlen(body);
+    int pos = 0;
+    int out_len = 0;
+    int used;
+    int n;
+    int k;
+
+    http_body_init(&b, head, strlen(head), 0);
+    while(pos < len && !b.done){
+        k = (len - pos < step) ? len - pos : step;
+        memcpy(buf, body + pos, k);
+        if((n = http_body_decode(&b, buf, k, &used)) < 0) return -1;
+        memcpy(out + out_len, buf, n);
+        out_len += n;
+        pos += used;
+    }
+    out[out_len] = '\0';
+    *rest = body + pos;
+    return b.done ? 0 : -1;
+}
+
+static void test_chunks(){
+    char out[MAX_BODY];
+    char got[MAX_BODY + 64];
+    const chunk_case* c;
+    const char* rest;
+    int step;
+    int i;
+    int ok;
+
+    for(i = 0; i < sizeof(chunk_cases) / sizeof(chunk_cases[0]); i++){
+        c = &chunk_cases[i];
+        for(step = 1; step <= strlen(c->body); step++){
+            if(decode_in_steps(c->body, step, out, &rest) < 0){
+                ok = (c->want == NULL);
+                strcpy(got, "(broken)");
+            }
+            else{
+                ok = c->want != NULL && !strcmp(out, c->want) &&
+                     !strcmp(rest, c->rest);
+                snprintf(got, sizeof(got), "%s|%s", out, rest);
+            }
+            check(ok, "chunked", c->body, got,
+                  (c->want != NULL) ? c->want : "(broken)");
+            if(!ok) break;
+        }
+    }
+}
+
+
+// Range headers against an entity of length bytes, count is what
+// http_ranges returns and want the ranges it found, as "first-last,..."
+typedef struct range_case
+{
+    const char* spec;
+    long length;
+    int max;
+    int count;
+    const char* want;
+} range_case;
+
+static const range_case range_cases[] = {
+    {"bytes=0-99", 1000, 4, 1, "0-99"},
+    {"bytes=0-", 1000, 4, 1, "0-999"},
+    {"bytes=90-200", 100, 4, 1, "90-99"},
+    {"bytes=-500", 100, 4, 1, "0-99"},
+    {"bytes=-1", 100, 4, 1, "99-99"},
+    {"bytes=-0", 100, 4, 0, ""},
+    {"bytes=100-", 100, 4, 0, ""},
+    {"bytes=0-", 0, 4, 0, ""},
+    {"bytes=1000-,0-0", 100, 4, 1, "0-0"},
+    {"bytes=0-9,5-14", 100, 4, 2, "0-9,5-14"},
+    {"bytes=0-0, -1", 10, 4, 2, "0-0,9-9"},
+    {"BYTES=1-2", 10, 4, 1, "1-2"},
+    {"bytes=0-1,2-3,4-5", 10, 2, -1, ""},
+    {"bytes=5-1", 10, 4, -1, ""},
+    {"bytes=abc", 10, 4, -1, ""},
+    {"bytes=0-1,x", 10, 4, -1, ""},
+    {"bytes=-", 10, 4, -1, ""},
+    {"items=0-1", 10, 4, -1, ""},
+};
+
+static void test_ranges(){
+    http_range ranges[MAX_CASE_RANGES];
+    char got[128];
+    const range_case* c;
+    int count;
+    int n;
+    int i;
+    int j;
+
+    for(i = 0; i < sizeof(range_cases) / sizeof(range_cases[0]); i++){
+        c = &range_cases[i];
+        count = http_ranges(c->spec, c->length, ranges, c->max);
+        n = sprintf(got, "%d:", count);
+        for(j = 0; j < count; j++){
+            n += sprintf(&got[n], "%s%ld-%ld", (j == 0) ? "" : ",",
+                         ranges[j].first, ranges[j].last);
+        }
+        check(count == c->count && !strcmp(strchr(got, ':') + 1, c->want),
+              "http_ranges", c->spec, got, c->want);
+    }
+}
+
+
+int main(){
+    test_urls();
+    test_dots();
+    test_chunks();
+    test_ranges();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures > 0;
+}
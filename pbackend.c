@@ -0,0 +1,208 @@
+#include "csapp.h"
+#include "phttp.h"
+#include "porigin.h"
+#include "pstats.h"
+#include "pbackend.h"
+
+typedef struct backend
+{
+    char host[MAXLINE];
+    int port;
+    int healthy;
+} backend;
+
+typedef struct route
+{
+    char host[MAXLINE];                 // "*" for any
+    char prefix[MAXLINE];
+    int backends[ROUTE_BACKENDS];
+    int count;
+} route;
+
+static backend backends[MAX_BACKENDS];
+static int backend_count = 0;
+static route routes[MAX_ROUTES];
+static int route_count = 0;
+static __thread unsigned int seed = 0;
+
+// returns the backend named host:port, adding it if it is new, -1 if the
+// name is malformed or there are too many
+static int add_backend(const char* name){
+    char host[MAXLINE];
+    int port;
+    int i;
+
+    if(sscanf(name, "%[^:]:%d", host, &port) != 2 || port <= 0) return -1;
+    for(i = 0; i < backend_count; i++){
+        if(backends[i].port == port && strcmp(backends[i].host, host) == 0){
+            return i;
+        }
+    }
+    if(backend_count == MAX_BACKENDS) return -1;
+    strcpy(backends[backend_count].host, host);
+    backends[backend_count].port = port;
+    backends[backend_count].healthy = 1;
+    return backend_count++;
+}
+
+// adds the route on a line split up by strtok_r, returns -1 if it is
+// malformed
+static int add_route(char* host, char** save){
+    route* r = &routes[route_count];
+    char* prefix = strtok_r(NULL, " \t\r\n", save);
+    char* name;
+    int b;
+
+    if(prefix == NULL || prefix[0] != '/' || route_count == MAX_ROUTES){
+        return -1;
+    }
+    snprintf(r->host, MAXLINE, "%s", host);
+    snprintf(r->prefix, MAXLINE, "%s", prefix);
+    r->count = 0;
+    while((name = strtok_r(NULL, " \t\r\n", save)) != NULL){
+        if(r->count == ROUTE_BACKENDS || (b = add_backend(name)) < 0){
+            return -1;
+        }
+        r->backends[r->count++] = b;
+    }
+    if(r->count == 0) return -1;
+    route_count++;
+    return 0;
+}
+
+int backend_init(const char* file){
+    char line[MAXLINE];
+    char* save;
+    char* host;
+    FILE* f;
+    int n = 0;
+
+    if((f = fopen(file, "r")) == NULL){
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while(fgets(line, MAXLINE, f) != NULL){
+        n++;
+        host = strtok_r(line, " \t\r\n", &save);
+        if(host == NULL || host[0] == '#') continue;
+        if(add_route(host, &save) < 0){
+            fprintf(stderr, "%s:%d: expected <host> </prefix> "
+                    "<host:port> ...\n", file, n);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    if(route_count == 0){
+        fprintf(stderr, "%s: no routes\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+int backend_route(const char* host, const char* path){
+    char name[MAXLINE];
+    int best = -1;
+    int best_len = -1;
+    int len;
+    int i;
+
+    // Host may carry a port
+    snprintf(name, MAXLINE, "%s", host);
+    name[strcspn(name, ":")] = '\0';
+
+    for(i = 0; i < route_count; i++){
+        if(strcmp(routes[i].host, "*") != 0 &&
+           strcasecmp(routes[i].host, name) != 0){
+            continue;
+        }
+        len = strlen(routes[i].prefix);
+        if(strncmp(path, routes[i].prefix, len) != 0) continue;
+
+        // a route for the host itself wins over "*" with the same prefix
+        if(len > best_len ||
+           (len == best_len && strcmp(routes[best].host, "*") == 0)){
+            best = i;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+int backend_pick(int r, char* host, int size, int* port){
+    int healthy[ROUTE_BACKENDS];
+    int count = 0;
+    int a, b;
+    int i;
+
+    if(seed == 0) seed = time(NULL) ^ (unsigned int)pthread_self();
+    for(i = 0; i < routes[r].count; i++){
+        if(__atomic_load_n(&backends[routes[r].backends[i]].healthy,
+                           __ATOMIC_RELAXED)){
+            healthy[count++] = routes[r].backends[i];
+        }
+    }
+    if(count == 0) return -1;
+
+    // two choices balance nearly as well as looking at every backend, and
+    // don't send everyone to the same least loaded one at once
+    a = healthy[rand_r(&seed) % count];
+    b = healthy[rand_r(&seed) % count];
+    if(origin_load(backends[b].host, backends[b].port) <
+       origin_load(backends[a].host, backends[a].port)){
+        a = b;
+    }
+    snprintf(host, size, "%s", backends[a].host);
+    *port = backends[a].port;
+    return 0;
+}
+
+// asks a backend for HEALTH_PATH, returns 1 if it answers without a 5xx
+static int check(backend* b){
+    struct timeval timeout = {HEALTH_TIMEOUT, 0};
+    char line[MAXLINE];
+    rio_t rio;
+    int status = 0;
+    int fd;
+    int len;
+
+    // a backend that drops the connect mustn't hold up checking the others
+    fd = open_clientfd_t(b->host, b->port, HEALTH_TIMEOUT * 1000);
+    if(fd < 0) return 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    len = snprintf(line, MAXLINE, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                   HEALTH_PATH, b->host);
+    if(rio_writen(fd, line, len) == len){
+        Rio_readinitb(&rio, fd);
+        if(rio_readlineb(&rio, line, MAXLINE) > 0) status = http_status(line);
+    }
+    close(fd);
+    return status > 0 && status < 500;
+}
+
+static void* health_thread(void* vargp){
+    int healthy;
+    int i;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        for(i = 0; i < backend_count; i++){
+            healthy = check(&backends[i]);
+            if(backends[i].healthy && !healthy){
+                stats_inc(STAT_BACKENDS_DOWN);
+            }
+            __atomic_store_n(&backends[i].healthy, healthy,
+                             __ATOMIC_RELAXED);
+        }
+        sleep(HEALTH_INTERVAL);
+    }
+    return NULL;
+}
+
+void backend_start_checks(){
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, health_thread, NULL);
+    return;
+}
@@ -0,0 +1,40 @@
+#ifndef PBACKEND_H_
+#define PBACKEND_H_
+
+// routes for reverse proxy mode, read from a file with one route a line:
+//
+//   <host> <path prefix> <backend host:port> [<backend host:port> ...]
+//
+// a request goes to the route with the longest prefix of its path among
+// those for its Host (without the port), or for host "*", and from there to
+// one of the route's backends, the less loaded of two picked at random
+// (power of two choices) among those passing their health checks
+// blank lines and lines starting with '#' are skipped
+
+// most routes, and backends across all of them
+#define MAX_ROUTES 64
+#define MAX_BACKENDS 64
+// most backends a single route spreads requests over
+#define ROUTE_BACKENDS 16
+// a backend is asked for HEALTH_PATH this often, in seconds, and is taken
+// out of rotation if it doesn't answer within HEALTH_TIMEOUT seconds or
+// answers with a 5xx
+#define HEALTH_PATH "/"
+#define HEALTH_INTERVAL 5
+#define HEALTH_TIMEOUT 2
+
+// reads the routes from file, returns -1 if it can't be read or a line is
+// malformed, after printing which
+int backend_init(const char* file);
+
+// starts the thread checking on the backends' health
+void backend_start_checks(void);
+
+// returns the route a request for path on host goes to, -1 if none
+int backend_route(const char* host, const char* path);
+
+// picks a backend of route for a request, setting its host and port,
+// returns -1 if none of them is healthy
+int backend_pick(int route, char* host, int size, int* port);
+
+#endif
@@ -0,0 +1,85 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "pbloom.h"
+
+struct bloom
+{
+    size_t size;                        // of the whole mapping
+    long window;
+    long words;                         // per filter
+    long added;                         // new keys in the current filter
+    int current;
+    uint64_t bits[];                    // both filters, one after the other
+};
+
+// the filters' bit positions for key, the key is already a hash, the
+// second one is derived from it to step between positions
+static void positions(bloom* b, uint64_t key, uint64_t* pos){
+    uint64_t n = b->words * 64;
+    uint64_t step = ((key >> 32) | (key << 32)) * 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    step |= 1;
+    for(i = 0; i < BLOOM_HASHES; i++) pos[i] = (key + i * step) % n;
+    return;
+}
+
+static int contains(uint64_t* filter, uint64_t* pos){
+    int i;
+
+    for(i = 0; i < BLOOM_HASHES; i++){
+        if(!(__atomic_load_n(&filter[pos[i] / 64], __ATOMIC_RELAXED) &
+             (1ULL << (pos[i] % 64)))){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+bloom* bloom_new(long window){
+    long words = (window * BLOOM_BITS_PER_KEY + 63) / 64;
+    size_t size = sizeof(bloom) + 2 * words * sizeof(uint64_t);
+    bloom* b;
+
+    if(window < 1) return NULL;
+    b = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(b == MAP_FAILED) return NULL;
+    b->size = size;
+    b->window = window;
+    b->words = words;
+    b->added = 0;
+    b->current = 0;
+    return b;
+}
+
+void bloom_free(bloom* b){
+    munmap(b, b->size);
+    return;
+}
+
+int bloom_admit(bloom* b, uint64_t key){
+    int current = __atomic_load_n(&b->current, __ATOMIC_ACQUIRE);
+    uint64_t* filter = b->bits + current * b->words;
+    uint64_t* older = b->bits + (1 - current) * b->words;
+    uint64_t pos[BLOOM_HASHES];
+    int seen;
+    int i;
+
+    positions(b, key, pos);
+    if(contains(filter, pos)) return 1;
+    seen = contains(older, pos);
+    for(i = 0; i < BLOOM_HASHES; i++){
+        __atomic_fetch_or(&filter[pos[i] / 64], 1ULL << (pos[i] % 64),
+                          __ATOMIC_RELAXED);
+    }
+
+    // the miss that fills the window ages the filters, keys only in the
+    // older one are forgotten
+    if(__atomic_add_fetch(&b->added, 1, __ATOMIC_RELAXED) == b->window){
+        memset(older, 0, b->words * sizeof(uint64_t));
+        __atomic_store_n(&b->added, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->current, 1 - current, __ATOMIC_RELEASE);
+    }
+    return seen;
+}
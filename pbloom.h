@@ -0,0 +1,35 @@
+#ifndef PBLOOM_H_
+#define PBLOOM_H_
+
+#include <stdint.h>
+
+// a doorkeeper in front of the cache: most URLs are only ever asked for
+// once, and caching them only pushes out objects that would have been hit
+// again, so with it a response is only cached on its URL's second miss
+// within a window
+// misses are recorded in two Bloom filters, the current one and the one
+// before it, once the current one has taken in window new keys the older
+// one is cleared and becomes the current one, so a key is remembered for
+// between one and two windows
+// the filters are in shared memory and updated without a lock, a race
+// costs at most a key being forgotten or admitted early
+
+// filter bits per key of a window, with BLOOM_HASHES bits set per key
+// about 1% of first misses get through
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+// default window, in keys
+#define BLOOM_WINDOW 16384
+
+typedef struct bloom bloom;
+
+// maps a doorkeeper with a window of window keys into shared memory,
+// processes forked afterwards share it, returns NULL on failure
+bloom* bloom_new(long window);
+void bloom_free(bloom* b);
+
+// records a miss on key, returns 1 if it already missed within the window
+// and is worth caching, 0 if this is its first
+int bloom_admit(bloom* b, uint64_t key);
+
+#endif
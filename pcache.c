@@ -1,94 +1,367 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "pcache.h"
+#include "pprobe.h"
+
+// the arena is carved into blocks, free ones are kept in address order so
+// that neighbours can be merged again when they are freed
+typedef struct block
+{
+    size_t size;                        // including this header
+    size_t next;                        // next free block, only when free
+} block;
+
+#define ALIGN 16
+#define BLOCK_SIZE ((sizeof(block) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+// the arena starts after the cache struct, so offset 0 is never a block
+#define ARENA_START ((sizeof(cache) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+
+#define AT(c, off) ((void*)((char*)(c) + (off)))
+#define OFF(c, p) ((size_t)((char*)(p) - (char*)(c)))
+#define OBJ(c, off) ((off) ? (object*)AT(c, off) : NULL)
+
+static int worker_id = 0;
+
+// makes the arena one big free block and forgets every object
+static void cache_clear(cache* c){
+    block* b = AT(c, ARENA_START);
+
+    b->size = c->arena_size - ARENA_START;
+    b->next = 0;
+    c->free = ARENA_START;
+    c->start = 0;
+    c->end = 0;
+    c->size = 0;
+    c->objects = 0;
+    return;
+}
+
+// returns an object able to hold size bytes of data, or NULL if no free
+// block is large enough (first fit)
+static object* cache_alloc(cache* c, int size){
+    size_t need = (BLOCK_SIZE + sizeof(object) + size + ALIGN - 1) &
+                  ~(size_t)(ALIGN - 1);
+    size_t* link = &c->free;
+    block* b;
+    block* used;
+
+    while(*link != 0){
+        b = AT(c, *link);
+        if(b->size >= need + BLOCK_SIZE + sizeof(object)){
+            // split, keeping the front of the block on the free list
+            b->size -= need;
+            used = AT(c, OFF(c, b) + b->size);
+            used->size = need;
+            return AT(c, OFF(c, used) + BLOCK_SIZE);
+        }
+        if(b->size >= need){
+            *link = b->next;
+            return AT(c, OFF(c, b) + BLOCK_SIZE);
+        }
+        link = &b->next;
+    }
+    return NULL;
+}
+
+// returns an object's block to the free list, merging it with free
+// neighbours
+static void cache_release(cache* c, object* obj){
+    size_t off = OFF(c, obj) - BLOCK_SIZE;
+    block* b = AT(c, off);
+    block* prev = NULL;
+    size_t next = c->free;
+
+    while(next != 0 && next < off){
+        prev = AT(c, next);
+        next = prev->next;
+    }
+
+    b->next = next;
+    if(next != 0 && off + b->size == next){
+        b->size += ((block*)AT(c, next))->size;
+        b->next = ((block*)AT(c, next))->next;
+    }
+    if(prev != NULL && OFF(c, prev) + prev->size == off){
+        prev->size += b->size;
+        prev->next = b->next;
+    }
+    else if(prev != NULL){
+        prev->next = off;
+    }
+    else{
+        c->free = off;
+    }
+    return;
+}
+
+// unlinks an object from the cache and frees it
+static void cache_remove(cache* c, object* obj){
+    if(obj->prev != 0) OBJ(c, obj->prev)->next = obj->next;
+    else c->start = obj->next;
+    if(obj->next != 0) OBJ(c, obj->next)->prev = obj->prev;
+    else c->end = obj->prev;
+
+    c->size -= obj->size;
+    c->objects--;
+    cache_release(c, obj);
+    return;
+}
 
 // removes the last element from the cache
 static void cache_evict(cache* c){
-    object* temp = c->end;
-    c->size -= temp->size;
-    c->end = c->end->prev;
-    c->end->next = NULL;
-    free(temp->key);
-    free(temp->data);
-    free(temp);
+    c->evictions++;
+    PROBE2(cache__evict, OBJ(c, c->end)->key, OBJ(c, c->end)->size);
+    cache_remove(c, OBJ(c, c->end));
     return;
 }
 
-// creates a new cache struct and initializes it
-cache* cache_new(){
+// creates a new cache struct and initializes it, in the file fd if it
+// isn't -1
+static cache* cache_map(size_t capacity, int fd){
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    size_t arena_size = ARENA_START + ((2*capacity + ALIGN - 1) &
+                                       ~(size_t)(ALIGN - 1));
     cache* c;
-    c = malloc(sizeof(cache));
-    c->start = NULL;
-    c->end = NULL;
-    c->size = 0;
+
+    if(fd >= 0 && ftruncate(fd, arena_size) < 0) return NULL;
+    c = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+             (fd >= 0) ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+    if(c == MAP_FAILED) return NULL;
+    memset(c, 0, sizeof(cache));
+    c->capacity = capacity;
+    c->arena_size = arena_size;
+    c->fd = fd;
+    cache_clear(c);
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->mutex, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&c->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    return c;
+}
+
+cache* cache_new(size_t capacity){
+    return cache_map(capacity, -1);
+}
+
+cache* cache_new_file(size_t capacity){
+    int fd = memfd_create("proxy-cache", MFD_CLOEXEC);
+    cache* c;
+
+    if(fd < 0) return NULL;
+    if((c = cache_map(capacity, fd)) == NULL) close(fd);
     return c;
 }
 
 // frees the cache struct and any objects it points to
 void cache_free(cache* c){
-    object* current = c->start;
-    object* next = NULL;
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+    if(c->fd >= 0) close(c->fd);
+    munmap(c, c->arena_size);
+    return;
+}
 
-    while(current != NULL){
-        next = current->next;
-        free(current->key);
-        free(current->data);
-        free(current);
-        current = next;
+off_t cache_file_offset(cache* c, const char* p){
+    uintptr_t start = (uintptr_t)c;
+
+    if(c->fd < 0 || (uintptr_t)p < start ||
+       (uintptr_t)p >= start + c->arena_size){
+        return -1;
     }
-    free(c);
+    return (uintptr_t)p - start;
+}
+
+void cache_attach(int worker){
+    worker_id = worker;
     return;
 }
 
-// creates and adds a new object to the cache
-// also remove elements from the cache to keep size(cache) < MAX_SIZE
-void cache_add(cache* c, char* key, char* data, int size){
-    object* obj = malloc(sizeof(object));
-    obj->key = malloc(strlen(key)+1);
-    obj->data = malloc(size*sizeof(char));
-    obj->size = size;
+// the mutex only guards the lock's counters, which are never left half
+// updated, so a holder that died leaves nothing to repair
+static void lock_mutex(cache* c){
+    if(pthread_mutex_lock(&c->mutex) == EOWNERDEAD){
+        pthread_mutex_consistent(&c->mutex);
+    }
+    return;
+}
 
-    strcpy(obj->key, key);
-    memcpy(obj->data, data, size);
+static void wait_cond(cache* c){
+    if(pthread_cond_wait(&c->cond, &c->mutex) == EOWNERDEAD){
+        pthread_mutex_consistent(&c->mutex);
+    }
+    return;
+}
 
-    obj->next = c->start;
-    obj->prev = NULL;
-    if(c->start != NULL) c->start->prev = obj;
-    c->start = obj;
-    c->size += size;
+static int reader_count(cache* c){
+    int count = 0;
+    int i;
+
+    for(i = 0; i < MAX_WORKERS; i++) count += c->readers[i];
+    return count;
+}
+
+void cache_reap(cache* c, int worker){
+    object* obj;
+
+    lock_mutex(c);
+    c->readers[worker] = 0;
+    if(c->writer == worker + 1){
+        cache_clear(c);
+        c->writer = 0;
+    }
+    for(obj = OBJ(c, c->start); obj != NULL; obj = OBJ(c, obj->next)){
+        if(obj->refreshing == worker + 1) obj->refreshing = 0;
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    return;
+}
+
+// readers have priority over writers and block them
+void cache_r_lock(cache* c){
+    lock_mutex(c);
+    while(c->writer != 0) wait_cond(c);
+    c->readers[worker_id]++;
+    pthread_mutex_unlock(&c->mutex);
+    return;
+}
+
+void cache_r_unlock(cache* c){
+    lock_mutex(c);
+    if(--c->readers[worker_id] == 0 && reader_count(c) == 0){
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return;
+}
+
+// a single writer at a time, with all readers blocked
+void cache_w_lock(cache* c){
+    lock_mutex(c);
+    while(c->writer != 0 || reader_count(c) != 0) wait_cond(c);
+    c->writer = worker_id + 1;
+    pthread_mutex_unlock(&c->mutex);
+    return;
+}
+
+void cache_w_unlock(cache* c){
+    lock_mutex(c);
+    c->writer = 0;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    return;
+}
+
+// creates and adds a new object to the cache, replacing any older copy
+// stored under the same key
+// also remove elements from the cache to keep size(cache) < capacity
+void cache_add(cache* c, uint64_t key, uint64_t check, uint64_t variant,
+               const char* head, int head_size,
+               const char* body, int body_size, meta* m){
+    object* old = cache_lookup(c, key, check, variant);
+    object* obj;
+    int size = head_size + body_size;
 
-    if(c->end == NULL) c->end = obj;
+    if(old != NULL) cache_remove(c, old);
 
-    // kick out last object
-    while(c->size > MAX_SIZE){
+    // kick out last objects until the new one fits
+    while(c->end != 0 && c->size + size > c->capacity) cache_evict(c);
+    while((obj = cache_alloc(c, size)) == NULL){
+        if(c->end == 0) return;
         cache_evict(c);
     }
+
+    obj->key = key;
+    obj->check = check;
+    obj->variant = variant;
+    obj->size = size;
+    obj->head_size = head_size;
+    obj->refreshing = 0;
+    obj->meta = *m;
+    if(head_size > 0) memcpy(object_data(obj), head, head_size);
+    if(body_size > 0) memcpy(object_body(obj), body, body_size);
+
+    obj->next = c->start;
+    obj->prev = 0;
+    if(c->start != 0) OBJ(c, c->start)->prev = OFF(c, obj);
+    c->start = OFF(c, obj);
+    c->size += size;
+    c->objects++;
+    c->insertions++;
+    PROBE2(cache__add, key, size);
+
+    if(c->end == 0) c->end = c->start;
     return;
 }
 
 // moves an object to the front of the cache
 // this symbolizes it being the most recently accessed
 void cache_update(cache* c, object* obj){
-    if(c->start == obj) return;
+    size_t off = OFF(c, obj);
+
+    if(c->start == off) return;
 
-    if(obj->next != NULL) obj->next->prev = obj->prev;
-    if(obj->prev != NULL){
-        obj->prev->next = obj->next;
-        if(c->end == obj) c->end = obj->prev;
+    if(obj->next != 0) OBJ(c, obj->next)->prev = obj->prev;
+    if(obj->prev != 0){
+        OBJ(c, obj->prev)->next = obj->next;
+        if(c->end == off) c->end = obj->prev;
     }
     obj->next = c->start;
-    obj->prev = NULL;
-    if(c->start != NULL) c->start->prev = obj;
-    c->start = obj;
+    obj->prev = 0;
+    if(c->start != 0) OBJ(c, c->start)->prev = off;
+    c->start = off;
     return;
 }
 
 // searches and returns a pointer to an object in the cache
-object* cache_lookup(cache* c, char* key){
-    object* current = c->start;
+object* cache_lookup(cache* c, uint64_t key, uint64_t check,
+                     uint64_t variant){
+    object* current = OBJ(c, c->start);
 
     while(current != NULL){
-        if(!strcmp(current->key, key)) return current;
-        current = current->next;
+        if(current->key == key && current->check == check &&
+           current->variant == variant){
+            return current;
+        }
+        current = OBJ(c, current->next);
     }
     return NULL;
 }
 
+// returns the Vary list of the most recently used object stored under key,
+// which says how to work out the variant to look up, or NULL if none
+const char* cache_vary(cache* c, uint64_t key, uint64_t check){
+    object* current = OBJ(c, c->start);
+
+    while(current != NULL){
+        if(current->key == key && current->check == check){
+            return current->meta.vary;
+        }
+        current = OBJ(c, current->next);
+    }
+    return NULL;
+}
+
+void cache_invalidate(cache* c, uint64_t key, uint64_t check){
+    object* current = OBJ(c, c->start);
+    object* next;
+
+    while(current != NULL){
+        next = OBJ(c, current->next);
+        if(current->key == key && current->check == check){
+            cache_remove(c, current);
+        }
+        current = next;
+    }
+    return;
+}
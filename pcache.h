@@ -3,30 +3,126 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 #define MAX_SIZE 1049000
 #define MAX_OBJ_SIZE 102400
+#define MAX_VALIDATOR 128
+#define MAX_VARY 128
+// most worker processes that can share one cache
+#define MAX_WORKERS 64
 
+// freshness and validator information kept alongside a cached response
+typedef struct meta
+{
+    time_t expires;                     // object is stale after this time
+    time_t stale_while;                 // may be served while revalidating
+    time_t stale_error;                 // may be served if the origin fails
+    char etag[MAX_VALIDATOR];           // empty if the origin sent none
+    char last_modified[MAX_VALIDATOR];  // empty if the origin sent none
+    char vary[MAX_VARY];                // header names the response varies on
+    int gzipped;                        // body is stored gzip compressed
+    time_t born;                        // when the origin sent it, for Age
+    int prefetched;                     // fetched ahead, not yet hit
+} meta;
+
+// objects are found by the hash of their URL and, for responses that vary
+// on request headers, the hash of those headers' values (0 otherwise),
+// a second hash of the URL, check, has to match as well, so that two URLs
+// with the same hash aren't taken for each other
+// the cache is shared between processes that may map it at different
+// addresses, so objects link to each other by offset (0 for none) and the
+// response data follows the object itself: the head, packed into a table
+// of header fields (see http_pack_head), then the body
 typedef struct object
 {
-    char* key;
-    char* data;
-    struct object* next;
-    struct object* prev;
-    int size;
+    uint64_t key;
+    uint64_t check;
+    uint64_t variant;
+    size_t next;
+    size_t prev;
+    int size;                           // of the head and body together
+    int head_size;
+    int refreshing;                     // worker+1 refreshing it, 0 if none
+    meta meta;
 } object;
 
 typedef struct cache
 {
-    struct object* start;
-    struct object* end;
+    size_t start;
+    size_t end;
     size_t size;
+    size_t capacity;                    // most data bytes held at once
+    size_t free;                        // first free block of the arena
+    size_t arena_size;
+    int fd;                             // the file behind it, -1 if none
+    size_t objects;
+    unsigned long insertions;
+    unsigned long evictions;
+
+    // a readers-writer lock that readers take priority in, kept in the
+    // region and robust, so that a worker dying while holding it doesn't
+    // hang the others, readers are counted per worker so a dead one's
+    // share can be dropped
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int writer;                         // worker+1 writing, 0 if none
+    int readers[MAX_WORKERS];
 } cache;
 
-cache* cache_new();
+// the response data stored with an object, starting with its head
+static inline char* object_data(object* obj){
+    return (char*)(obj + 1);
+}
+
+static inline char* object_body(object* obj){
+    return object_data(obj) + obj->head_size;
+}
+
+static inline int object_body_size(object* obj){
+    return obj->size - obj->head_size;
+}
+
+// creates a cache holding up to capacity bytes of responses in shared
+// memory, processes forked afterwards share it
+// the region is twice that size so that object headers and fragmentation
+// don't force early evictions
+cache* cache_new(size_t capacity);
+// the same with the region kept in a memory backed file instead of
+// anonymous memory, so object bodies can be sent straight from the page
+// cache with sendfile
+cache* cache_new_file(size_t capacity);
 void cache_free(cache* c);
-void cache_add(cache* c, char* key, char* data, int size);
+
+// where p is in the cache's file, or -1 if the cache has none or p doesn't
+// point into it
+off_t cache_file_offset(cache* c, const char* p);
+
+// sets which worker the calling process is, for the lock bookkeeping
+void cache_attach(int worker);
+
+// cleans up after a worker that died: gives up the locks it held and the
+// refreshes it was running, a worker that died while changing the cache
+// leaves it in an unknown state, so the cache is emptied
+void cache_reap(cache* c, int worker);
+
+void cache_r_lock(cache* c);
+void cache_r_unlock(cache* c);
+void cache_w_lock(cache* c);
+void cache_w_unlock(cache* c);
+
+// the following need the caller to hold the lock
+void cache_add(cache* c, uint64_t key, uint64_t check, uint64_t variant,
+               const char* head, int head_size,
+               const char* body, int body_size, meta* m);
 void cache_update(cache* c, object* obj);
-object* cache_lookup(cache* c, char* key);
+object* cache_lookup(cache* c, uint64_t key, uint64_t check,
+                     uint64_t variant);
+const char* cache_vary(cache* c, uint64_t key, uint64_t check);
+// removes every variant stored under key
+void cache_invalidate(cache* c, uint64_t key, uint64_t check);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,143 @@
+#include <sys/timerfd.h>
+#include "csapp.h"
+#include "pstats.h"
+#include "pdeadline.h"
+
+// near[] holds the next WHEEL_NEAR ticks one per slot, far[l] the ticks
+// WHEEL_NEAR * WHEEL_FAR^l and more away, as wide a slot as the level
+// before it in full
+static deadline* near[WHEEL_NEAR];
+static deadline* far[WHEEL_LEVELS - 1][WHEEL_FAR];
+static uint64_t current = 0;            // the next tick to be turned
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int tick_fd = -1;
+
+// the tick a deadline fires on, rounded up so it never fires early
+static uint64_t tick_of(uint64_t expires){
+    return (expires + DEADLINE_TICK - 1) / DEADLINE_TICK;
+}
+
+// puts d in the slot for its tick relative to current, with mutex held
+static void insert(deadline* d){
+    uint64_t tick = tick_of(d->expires);
+    uint64_t ahead;
+    deadline** slot;
+    int shift = WHEEL_NEAR_BITS;
+    int l;
+
+    // already due, the next turn picks it up
+    if(tick < current) tick = current;
+    ahead = tick - current;
+
+    if(ahead < WHEEL_NEAR){
+        slot = &near[tick & (WHEEL_NEAR - 1)];
+    }
+    else{
+        for(l = 0; l < WHEEL_LEVELS - 2; l++){
+            if(ahead < (uint64_t)1 << (shift + WHEEL_FAR_BITS)) break;
+            shift += WHEEL_FAR_BITS;
+        }
+        // anything further off than the wheel reaches waits in the last
+        // slot it does and is spread out again from there
+        if(ahead >= (uint64_t)1 << (shift + WHEEL_FAR_BITS)){
+            tick = current + ((uint64_t)1 << (shift + WHEEL_FAR_BITS)) - 1;
+        }
+        slot = &far[l][(tick >> shift) & (WHEEL_FAR - 1)];
+    }
+
+    d->next = *slot;
+    if(*slot != NULL) (*slot)->prev = &d->next;
+    d->prev = slot;
+    *slot = d;
+    return;
+}
+
+static void unlink_deadline(deadline* d){
+    *d->prev = d->next;
+    if(d->next != NULL) d->next->prev = d->prev;
+    d->prev = NULL;
+    return;
+}
+
+// moves every deadline in far[l]'s slot for current down a level, and
+// the level above's into this one first when this level comes round
+static void cascade(int l){
+    int shift = WHEEL_NEAR_BITS + l * WHEEL_FAR_BITS;
+    int index = (current >> shift) & (WHEEL_FAR - 1);
+    deadline* d;
+
+    if(index == 0 && l + 1 < WHEEL_LEVELS - 1) cascade(l + 1);
+    d = far[l][index];
+    far[l][index] = NULL;
+    while(d != NULL){
+        deadline* next = d->next;
+        insert(d);
+        d = next;
+    }
+    return;
+}
+
+void deadline_advance(uint64_t now){
+    uint64_t tick = now / DEADLINE_TICK;
+    deadline* d;
+
+    pthread_mutex_lock(&mutex);
+    if(current == 0) current = tick;
+    while(current <= tick){
+        if((current & (WHEEL_NEAR - 1)) == 0) cascade(0);
+
+        // everything in a near slot is due on its tick
+        while((d = near[current & (WHEEL_NEAR - 1)]) != NULL){
+            unlink_deadline(d);
+            d->fire(d);
+        }
+        current++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return;
+}
+
+static void* watchdog(void* vargp){
+    uint64_t ticks;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        if(read(tick_fd, &ticks, sizeof(ticks)) != sizeof(ticks)) continue;
+        deadline_advance(stats_clock());
+    }
+    return NULL;
+}
+
+int deadline_init(){
+    struct itimerspec spec;
+    pthread_t tid;
+
+    if((tick_fd = timerfd_create(CLOCK_MONOTONIC, 0)) < 0) return -1;
+    spec.it_interval.tv_sec = DEADLINE_TICK / 1000000;
+    spec.it_interval.tv_nsec = DEADLINE_TICK % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    if(timerfd_settime(tick_fd, 0, &spec, NULL) < 0){
+        close(tick_fd);
+        tick_fd = -1;
+        return -1;
+    }
+    deadline_advance(stats_clock());
+    Pthread_create(&tid, NULL, watchdog, NULL);
+    return 0;
+}
+
+void deadline_arm(deadline* d, uint64_t expires){
+    pthread_mutex_lock(&mutex);
+    if(d->prev != NULL) unlink_deadline(d);
+    d->expires = expires;
+    insert(d);
+    pthread_mutex_unlock(&mutex);
+    return;
+}
+
+void deadline_cancel(deadline* d){
+    pthread_mutex_lock(&mutex);
+    if(d->prev != NULL) unlink_deadline(d);
+    pthread_mutex_unlock(&mutex);
+    return;
+}
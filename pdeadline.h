@@ -0,0 +1,47 @@
+#ifndef PDEADLINE_H_
+#define PDEADLINE_H_
+
+#include <stdint.h>
+
+// deadlines kept on a hierarchical timing wheel that a watchdog thread
+// turns on a timerfd tick of DEADLINE_TICK: the first level has a slot per
+// tick for the next WHEEL_NEAR ticks, each further level has WHEEL_FAR
+// slots each as wide as the whole level below, and a slot is spread out
+// into the level below once the wheel reaches it
+// arming and cancelling are a list insert and unlink, whatever the number
+// of deadlines, and a deadline is only touched once per level on its way
+// down, so connections cost nothing while their deadlines are far off
+#define WHEEL_NEAR_BITS 8
+#define WHEEL_FAR_BITS 6
+#define WHEEL_LEVELS 5
+#define WHEEL_NEAR (1 << WHEEL_NEAR_BITS)
+#define WHEEL_FAR (1 << WHEEL_FAR_BITS)
+// resolution of the wheel, in microseconds
+#define DEADLINE_TICK 10000
+
+typedef struct deadline
+{
+    uint64_t expires;                   // stats_clock() time, in us
+    struct deadline* next;
+    struct deadline** prev;             // whatever points to this one
+    // called by the watchdog once expires has passed, with the wheel
+    // locked, so it can't run once deadline_cancel has returned, and it
+    // mustn't arm or cancel deadlines itself
+    void (*fire)(struct deadline* d);
+} deadline;
+
+// starts the watchdog thread, returns -1 if the timerfd can't be made
+int deadline_init(void);
+
+// arms d to fire at expires, rearming it if it was already armed
+void deadline_arm(deadline* d, uint64_t expires);
+
+// disarms d, when it returns d's fire isn't running and won't be called
+void deadline_cancel(deadline* d);
+
+// fires everything due by now, this is what the watchdog calls on every
+// tick, it is only called directly to drive the wheel without the
+// watchdog, the first call sets the wheel's time
+void deadline_advance(uint64_t now);
+
+#endif
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "phist.h"
+
+// position of the highest set bit of a non-zero value
+static int msb(uint64_t value){
+    return 63 - __builtin_clzll(value);
+}
+
+static int bucket_of(uint64_t value){
+    int shift;
+
+    if(value < HIST_SUB_BUCKETS) return value;
+
+    // the top seven bits pick the bucket within the value's magnitude
+    shift = msb(value) - 6;
+    return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+           (int)(value >> shift) - HIST_HALF_BUCKETS;
+}
+
+// the largest value that falls in a bucket
+static uint64_t bucket_top(int bucket){
+    int shift;
+    uint64_t top;
+
+    if(bucket < HIST_SUB_BUCKETS) return bucket;
+
+    bucket -= HIST_SUB_BUCKETS;
+    shift = bucket / HIST_HALF_BUCKETS + 1;
+    top = bucket % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+void hist_init(hist* h){
+    memset(h, 0, sizeof(hist));
+    h->min = UINT64_MAX;
+    return;
+}
+
+void hist_record(hist* h, uint64_t value){
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    h->sum += value;
+    if(value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+    return;
+}
+
+void hist_record_atomic(hist* h, uint64_t value){
+    uint64_t seen;
+
+    __atomic_fetch_add(&h->counts[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while(value < seen &&
+          !__atomic_compare_exchange_n(&h->min, &seen, value, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(value > seen &&
+          !__atomic_compare_exchange_n(&h->max, &seen, value, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return;
+}
+
+void hist_merge(hist* dst, const hist* src){
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if(src->min < dst->min) dst->min = src->min;
+    if(src->max > dst->max) dst->max = src->max;
+    return;
+}
+
+uint64_t hist_percentile(const hist* h, double percent){
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t top;
+    int i;
+
+    if(h->total == 0) return 0;
+
+    rank = (uint64_t)(percent / 100.0 * h->total + 0.5);
+    if(rank < 1) rank = 1;
+    for(i = 0; i < HIST_BUCKETS; i++){
+        seen += h->counts[i];
+        if(seen >= rank){
+            top = bucket_top(i);
+            return (top > h->max) ? h->max : top;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const hist* h){
+    return (h->total == 0) ? 0.0 : (double)h->sum / h->total;
+}
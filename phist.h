@@ -0,0 +1,40 @@
+#ifndef PHIST_H_
+#define PHIST_H_
+
+#include <stdint.h>
+
+// latency histogram in the style of HdrHistogram: values below
+// HIST_SUB_BUCKETS are counted exactly, larger ones in buckets a
+// 1/HIST_HALF_BUCKETS fraction of their magnitude wide, so every recorded
+// value is known to within about 1.5%
+#define HIST_SUB_BUCKETS 128
+#define HIST_HALF_BUCKETS 64
+#define HIST_MAGNITUDES 58
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + HIST_MAGNITUDES*HIST_HALF_BUCKETS)
+
+typedef struct hist
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} hist;
+
+void hist_init(hist* h);
+void hist_record(hist* h, uint64_t value);
+
+// hist_record for a histogram several threads record into at once, it
+// takes no lock, each count is added atomically
+void hist_record_atomic(hist* h, uint64_t value);
+
+// adds every value recorded in src to dst
+void hist_merge(hist* dst, const hist* src);
+
+// returns the value below which percent (0 to 100) of the recorded values
+// fall, rounded up to the top of its bucket, 0 if nothing was recorded
+uint64_t hist_percentile(const hist* h, double percent);
+
+double hist_mean(const hist* h);
+
+#endif
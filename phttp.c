@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "phttp.h"
+
+// finds the end of the line starting at p, returns a pointer to the '\n'
+// or NULL if the line runs past end
+static const char* line_end(const char* p, const char* end){
+    while(p < end && *p != '\n') p++;
+    return (p < end) ? p : NULL;
+}
+
+int http_head_length(const char* data, int size){
+    const char* p = data;
+    const char* end = data + size;
+    const char* eol;
+
+    // the head ends with the first empty line ("\r\n" or "\n")
+    while((eol = line_end(p, end)) != NULL){
+        if(eol == p || (eol == p+1 && *p == '\r')) return eol + 1 - data;
+        p = eol + 1;
+    }
+    return 0;
+}
+
+int http_status(const char* head){
+    int status;
+
+    if(strncmp(head, "HTTP/", strlen("HTTP/")) != 0) return 0;
+    if(sscanf(head, "HTTP/%*d.%*d %d", &status) != 1) return 0;
+    return status;
+}
+
+// looks for header name in the header lines between p and end
+static int find_field(const char* p, const char* end, const char* name,
+                      char* value, int size){
+    const char* eol;
+    int n = strlen(name);
+    int vlen;
+
+    while((eol = line_end(p, end)) != NULL){
+        if(eol == p || (eol == p+1 && *p == '\r')) break;   // end of head
+        if(eol - p > n && p[n] == ':' && !strncasecmp(p, name, n)){
+            p += n + 1;
+            while(p < eol && (*p == ' ' || *p == '\t')) p++;
+
+            // strip trailing whitespace and the carriage return
+            while(eol > p && isspace((unsigned char)eol[-1])) eol--;
+            vlen = eol - p;
+            if(vlen >= size) vlen = size - 1;
+            memcpy(value, p, vlen);
+            value[vlen] = '\0';
+            return 1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+int http_header(const char* head, int len, const char* name,
+                char* value, int size){
+    const char* end = head + len;
+    const char* p = line_end(head, end);    // skip the status line
+
+    return (p != NULL) ? find_field(p+1, end, name, value, size) : 0;
+}
+
+int http_field(const char* block, const char* name, char* value, int size){
+    return find_field(block, block + strlen(block), name, value, size);
+}
+
+int http_via_has(const char* block, const char* by){
+    const char* end = block + strlen(block);
+    const char* p = block;
+    const char* eol;
+    const char* q;
+    int n = strlen(by);
+
+    // every Via line counts, the proxies a request went through may each
+    // have added their own rather than appending to the last one
+    while((eol = line_end(p, end)) != NULL){
+        if(eol == p || (eol == p+1 && *p == '\r')) break;   // end of head
+        if(eol - p > 4 && !strncasecmp(p, "Via:", 4)){
+            q = p + 4;
+            while(q < eol){
+                // each entry is a protocol, who received it and a comment
+                while(q < eol && (*q == ',' || isspace((unsigned char)*q))){
+                    q++;
+                }
+                while(q < eol && *q != ',' && !isspace((unsigned char)*q)){
+                    q++;
+                }
+                while(q < eol && (*q == ' ' || *q == '\t')) q++;
+                if(eol - q >= n && !strncasecmp(q, by, n) &&
+                   (q + n == eol || q[n] == ',' ||
+                    isspace((unsigned char)q[n]))){
+                    return 1;
+                }
+                while(q < eol && *q != ',') q++;
+            }
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+int http_rewrite_head(char* dst, int size, const char* head, int len,
+                      const char* status, const char** drop,
+                      const char* extra){
+    const char* end = head + len;
+    const char* p = head;
+    const char* eol = line_end(p, end);
+    int n = 0;
+    int i;
+    int dlen;
+    int skip;
+
+    if(eol == NULL) return -1;
+
+    // the status line is either replaced or copied as is
+    if(status != NULL){
+        if(strlen(status) + 2 >= size) return -1;
+        n = sprintf(dst, "%s\r\n", status);
+    }
+    else{
+        if(eol + 1 - p >= size) return -1;
+        memcpy(dst, p, eol + 1 - p);
+        n = eol + 1 - p;
+    }
+
+    for(p = eol + 1; (eol = line_end(p, end)) != NULL; p = eol + 1){
+        if(eol == p || (eol == p+1 && *p == '\r')) break;
+
+        skip = 0;
+        for(i = 0; drop != NULL && drop[i] != NULL; i++){
+            dlen = strlen(drop[i]);
+            if(eol - p > dlen && p[dlen] == ':' &&
+               !strncasecmp(p, drop[i], dlen)){
+                skip = 1;
+                break;
+            }
+        }
+        if(skip) continue;
+
+        if(n + (eol + 1 - p) >= size) return -1;
+        memcpy(&dst[n], p, eol + 1 - p);
+        n += eol + 1 - p;
+    }
+
+    if(extra == NULL) extra = "";
+    if(n + strlen(extra) + 3 > size) return -1;
+    n += sprintf(&dst[n], "%s\r\n", extra);
+    return n;
+}
+
+int http_pack_head(char* dst, int size, const char* head, int len){
+    const char* end = head + len;
+    const char* p = head;
+    const char* eol = line_end(p, end);
+    const char* colon;
+    const char* value;
+    const char* vend;
+    int n;
+
+    if(eol == NULL) return -1;
+
+    // the status line without its line ending
+    vend = eol;
+    while(vend > p && isspace((unsigned char)vend[-1])) vend--;
+    if(vend - p + 1 > size) return -1;
+    memcpy(dst, p, vend - p);
+    dst[vend - p] = '\0';
+    n = vend - p + 1;
+
+    for(p = eol + 1; (eol = line_end(p, end)) != NULL; p = eol + 1){
+        if(eol == p || (eol == p+1 && *p == '\r')) break;
+        if((colon = memchr(p, ':', eol - p)) == NULL) continue;
+
+        value = colon + 1;
+        while(value < eol && (*value == ' ' || *value == '\t')) value++;
+        vend = eol;
+        while(vend > value && isspace((unsigned char)vend[-1])) vend--;
+        if(n + (colon - p) + (vend - value) + 2 > size) return -1;
+
+        memcpy(dst + n, p, colon - p);
+        n += colon - p;
+        dst[n++] = '\0';
+        memcpy(dst + n, value, vend - value);
+        n += vend - value;
+        dst[n++] = '\0';
+    }
+    return n;
+}
+
+int http_packed_field(const char* packed, int len, const char* name,
+                      char* value, int size){
+    const char* end = packed + len;
+    const char* p = packed + strlen(packed) + 1;
+    const char* v;
+    int vlen;
+
+    for(; p < end; p = v + strlen(v) + 1){
+        v = p + strlen(p) + 1;
+        if(v >= end) break;
+        if(!strcasecmp(p, name)){
+            vlen = strlen(v);
+            if(vlen >= size) vlen = size - 1;
+            memcpy(value, v, vlen);
+            value[vlen] = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_unpack_head(char* dst, int size, const char* packed, int len,
+                     const char* status, const char** drop,
+                     const char* extra){
+    const char* end = packed + len;
+    const char* p = packed;
+    const char* v;
+    int n;
+    int i;
+    int skip;
+
+    if(status == NULL) status = packed;
+    if(strlen(status) + 2 >= size) return -1;
+    n = sprintf(dst, "%s\r\n", status);
+
+    for(p += strlen(p) + 1; p < end; p = v + strlen(v) + 1){
+        v = p + strlen(p) + 1;
+        if(v >= end) break;
+
+        skip = 0;
+        for(i = 0; drop != NULL && drop[i] != NULL; i++){
+            if(!strcasecmp(p, drop[i])){
+                skip = 1;
+                break;
+            }
+        }
+        if(skip) continue;
+
+        if(n + strlen(p) + strlen(v) + 4 >= size) return -1;
+        n += sprintf(&dst[n], "%s: %s\r\n", p, v);
+    }
+
+    if(extra == NULL) extra = "";
+    if(n + strlen(extra) + 3 > size) return -1;
+    n += sprintf(&dst[n], "%s\r\n", extra);
+    return n;
+}
+
+int http_ranges(const char* spec, long length, http_range* ranges, int max){
+    const char* p = spec;
+    char* end;
+    long first, last, suffix;
+    int count = 0;
+
+    if(strncasecmp(p, "bytes=", strlen("bytes=")) != 0) return -1;
+    p += strlen("bytes=");
+
+    while(*p != '\0'){
+        while(*p == ' ' || *p == ',') p++;
+        if(*p == '\0') break;
+
+        // "-n" asks for the last n bytes
+        if(*p == '-'){
+            suffix = strtol(p+1, &end, 10);
+            if(end == p+1 || suffix < 0) return -1;
+            first = (suffix >= length) ? 0 : length - suffix;
+            if(suffix == 0) first = length;
+            last = length - 1;
+        }
+        else{
+            first = strtol(p, &end, 10);
+            if(end == p || *end != '-' || first < 0) return -1;
+            p = end + 1;
+            if(*p >= '0' && *p <= '9'){
+                last = strtol(p, &end, 10);
+                if(last < first) return -1;
+            }
+            else{
+                last = length - 1;
+                end = (char*)p;
+            }
+            if(last >= length) last = length - 1;
+        }
+        while(*end == ' ') end++;
+        if(*end != '\0' && *end != ',') return -1;
+        p = end;
+
+        // ranges starting past the end can't be satisfied and are dropped
+        if(first >= length) continue;
+        if(count == max) return -1;
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
+    }
+    return count;
+}
+
+int http_cc_directive(const char* cc, const char* directive, long* arg){
+    const char* p = cc;
+    int n = strlen(directive);
+
+    while(*p != '\0'){
+        while(*p == ' ' || *p == ',') p++;
+        if(!strncasecmp(p, directive, n) &&
+           (p[n] == '\0' || p[n] == ',' || p[n] == ' ' || p[n] == '=')){
+            if(arg != NULL) *arg = (p[n] == '=') ? atol(&p[n+1]) : 0;
+            return 1;
+        }
+        while(*p != '\0' && *p != ',') p++;
+    }
+    return 0;
+}
+
+int http_accepts(const char* accept, const char* coding){
+    const char* p = accept;
+    const char* next;
+    const char* q;
+    int n = strlen(coding);
+    int len;
+    int refused;
+    int star = 0;
+
+    while(*p != '\0'){
+        while(*p == ' ' || *p == ',') p++;
+        len = strcspn(p, " ;,");
+        next = p + strcspn(p, ",");
+
+        // "gzip;q=0" explicitly refuses the coding
+        q = strstr(p, "q=");
+        refused = (q != NULL && q < next && atof(q+2) == 0.0);
+
+        if(len == n && !strncasecmp(p, coding, n)) return !refused;
+        if(len == 1 && *p == '*') star = !refused;
+        p = next;
+    }
+    return star;
+}
+
+time_t http_date(const char* date){
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if(strptime(date, "%a, %d %b %Y %H:%M:%S", &tm) == NULL) return -1;
+    return timegm(&tm);
+}
+
+int http_format_date(char* dst, int size, time_t t){
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    return strftime(dst, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+// the steps through a chunked body, chunk by chunk and then the trailers
+enum chunk_state
+{
+    CHUNK_SIZE,                         // hex digits of the size
+    CHUNK_EXT,                          // extensions up to the line's end
+    CHUNK_SIZE_LF,                      // the size line's \n
+    CHUNK_DATA,
+    CHUNK_DATA_CR,                      // the \r\n after the data
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,                // a trailer line, or the blank line
+    CHUNK_TRAILER,
+    CHUNK_END_LF                        // the final blank line's \n
+};
+
+void http_body_init(http_body* b, const char* head, int len, int head_only){
+    char value[128];
+    int status = http_status(head);
+    char* end;
+
+    memset(b, 0, sizeof(http_body));
+    b->state = CHUNK_SIZE;
+
+    // a Transfer-Encoding overrides any Content-Length, an encoding other
+    // than chunked leaves the close to end the body
+    if(head_only || (status >= 100 && status < 200) || status == 204 ||
+       status == 304){
+        b->framing = HTTP_NO_BODY;
+    }
+    else if(http_header(head, len, "Transfer-Encoding", value,
+                        sizeof(value))){
+        len = strlen(value);
+        b->framing = (len >= 7 && !strcasecmp(value + len - 7, "chunked")) ?
+                     HTTP_CHUNKED : HTTP_CLOSE;
+    }
+    else if(http_header(head, len, "Content-Length", value, sizeof(value)) &&
+            (b->left = strtol(value, &end, 10)) >= 0 && end != value){
+        b->framing = HTTP_LENGTH;
+    }
+    else{
+        b->framing = HTTP_CLOSE;
+    }
+    b->done = (b->framing == HTTP_NO_BODY ||
+               (b->framing == HTTP_LENGTH && b->left == 0));
+    return;
+}
+
+// a chunk's size line has been read, the last chunk has size 0
+static void size_done(http_body* b){
+    b->digits = 0;
+    b->state = (b->left == 0) ? CHUNK_TRAILER_START : CHUNK_DATA;
+    return;
+}
+
+// steps through chunked framing, copying the chunks' data down to out
+static int decode_chunked(http_body* b, char* data, int n, int* used){
+    char* out = data;
+    int i = 0;
+    int take;
+    int c;
+
+    while(i < n && !b->done){
+        c = (unsigned char)data[i];
+        switch(b->state){
+        case CHUNK_SIZE:
+            if(isxdigit(c)){
+                if(b->left > (0x7fffffffL >> 4)) return -1;
+                b->left = b->left * 16 +
+                          (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+                b->digits++;
+                break;
+            }
+            if(b->digits == 0) return -1;
+            if(c == ';' || c == ' ' || c == '\t') b->state = CHUNK_EXT;
+            else if(c == '\r') b->state = CHUNK_SIZE_LF;
+            else if(c == '\n') size_done(b);
+            else return -1;
+            break;
+        case CHUNK_EXT:
+            if(c == '\n') size_done(b);
+            break;
+        case CHUNK_SIZE_LF:
+            if(c != '\n') return -1;
+            size_done(b);
+            break;
+        case CHUNK_DATA:
+            take = (n - i < b->left) ? n - i : b->left;
+            memmove(out, data + i, take);
+            out += take;
+            b->left -= take;
+            i += take;
+            if(b->left == 0) b->state = CHUNK_DATA_CR;
+            continue;
+        case CHUNK_DATA_CR:
+            if(c == '\r') b->state = CHUNK_DATA_LF;
+            else if(c == '\n') b->state = CHUNK_SIZE;
+            else return -1;
+            break;
+        case CHUNK_DATA_LF:
+            if(c != '\n') return -1;
+            b->state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER_START:
+            if(c == '\r') b->state = CHUNK_END_LF;
+            else if(c == '\n') b->done = 1;
+            else b->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            if(c == '\n') b->state = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_END_LF:
+            if(c != '\n') return -1;
+            b->done = 1;
+            break;
+        }
+        i++;
+    }
+    *used = i;
+    return out - data;
+}
+
+int http_body_decode(http_body* b, char* data, int n, int* used){
+    *used = 0;
+    if(b->done) return 0;
+
+    switch(b->framing){
+    case HTTP_LENGTH:
+        if(n > b->left) n = b->left;
+        b->left -= n;
+        b->done = (b->left == 0);
+        *used = n;
+        return n;
+    case HTTP_CHUNKED:
+        return decode_chunked(b, data, n, used);
+    case HTTP_CLOSE:
+        *used = n;
+        return n;
+    }
+    return 0;
+}
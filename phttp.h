@@ -0,0 +1,109 @@
+#ifndef PHTTP_H_
+#define PHTTP_H_
+
+#include <time.h>
+
+// returns the length of the response head (status line and headers up to
+// and including the blank line) or 0 if data holds no complete head
+int http_head_length(const char* data, int size);
+
+// returns the status code from a response's status line, 0 if malformed
+int http_status(const char* head);
+
+// copies the value of the first header named name (case insensitive) into
+// value, returns 1 if the header was found and 0 otherwise
+int http_header(const char* head, int len, const char* name,
+                char* value, int size);
+
+// the same as http_header but for a block of header lines with no status
+// or request line in front, such as the headers a client sent
+int http_field(const char* block, const char* name, char* value, int size);
+
+// returns 1 if any Via line in a block of header lines has an entry
+// received by by ("1.1 by" or "1.1 by (comment)"), compared as a whole
+int http_via_has(const char* block, const char* by);
+
+// writes a copy of a response head to dst, replacing the status line with
+// status (unless it is NULL), leaving out headers named in the NULL
+// terminated list drop and adding the header lines in extra
+// returns the length of the new head or -1 if it doesn't fit in size
+int http_rewrite_head(char* dst, int size, const char* head, int len,
+                      const char* status, const char** drop,
+                      const char* extra);
+
+// packs a response head into the compact table it is cached as: the
+// status line, then the name and the value of each header field, each a
+// NUL terminated string, returns the packed length or -1 if it doesn't fit
+// in size
+int http_pack_head(char* dst, int size, const char* head, int len);
+
+// the same as http_header for a packed head
+int http_packed_field(const char* packed, int len, const char* name,
+                      char* value, int size);
+
+// the same as http_rewrite_head, but writing a packed head back out as
+// text
+int http_unpack_head(char* dst, int size, const char* packed, int len,
+                     const char* status, const char** drop,
+                     const char* extra);
+
+// a satisfiable byte range, first and last are inclusive offsets
+typedef struct http_range
+{
+    long first;
+    long last;
+} http_range;
+
+// parses the value of a Range header ("bytes=0-99,200-") for an entity of
+// length bytes, returns the number of satisfiable ranges stored in ranges,
+// 0 if none can be satisfied, or -1 if the header should be ignored
+// (malformed, not in bytes or more than max ranges)
+int http_ranges(const char* spec, long length, http_range* ranges, int max);
+
+// returns 1 if the comma separated Cache-Control value cc holds directive,
+// storing its numeric argument (if any) in arg
+int http_cc_directive(const char* cc, const char* directive, long* arg);
+
+// returns 1 if an Accept-Encoding value allows the content coding coding,
+// either by name or through "*", without a q value of 0
+int http_accepts(const char* accept, const char* coding);
+
+// how the end of a response's body is found
+enum http_framing
+{
+    HTTP_NO_BODY,                       // HEAD, 1xx, 204 and 304 responses
+    HTTP_LENGTH,                        // after Content-Length bytes
+    HTTP_CHUNKED,                       // at the last chunk and trailers
+    HTTP_CLOSE                          // when the connection closes
+};
+
+// the state of decoding a response body as it arrives, whatever its
+// framing, so that its end is found without the connection closing
+typedef struct http_body
+{
+    int framing;
+    int state;                          // where in the chunked framing
+    int digits;                         // of the chunk size read so far
+    long left;                          // of the body or the current chunk
+    int done;                           // the whole body has been decoded
+} http_body;
+
+// starts decoding the body of the response with the given head, head_only
+// says whether it answers a HEAD request, which has no body
+void http_body_init(http_body* b, const char* head, int len, int head_only);
+
+// decodes the n bytes of the response at data, leaving just the body's own
+// bytes (without chunk sizes, extensions and trailers) at the start of
+// data, returns how many there are, or -1 if the framing is broken
+// *used is set to the bytes that belonged to the response, anything after
+// them and once b->done is set comes after the response
+int http_body_decode(http_body* b, char* data, int n, int* used);
+
+// converts an RFC 1123 date ("Sun, 06 Nov 1994 08:49:37 GMT") to a time_t,
+// returns -1 if the date can't be parsed
+time_t http_date(const char* date);
+
+// writes t as an RFC 1123 date, returns its length
+int http_format_date(char* dst, int size, time_t t);
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "pkey.h"
+
+#define MAX_PARAMS 128
+
+static int sort_query = 0;
+static char strip_list[MAX_URL] = "";
+
+void key_init(int sort, const char* strip){
+    sort_query = sort;
+    strip_list[0] = '\0';
+    if(strip != NULL && strlen(strip) < MAX_URL - 2){
+        // wrap the list in commas so names can be matched as ",name,"
+        sprintf(strip_list, ",%s,", strip);
+    }
+    return;
+}
+
+uint64_t key_hash(const void* data, int len, uint64_t seed){
+    const unsigned char* p = data;
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    int i;
+
+    // FNV-1a followed by a final mix so that nearby keys spread out
+    for(i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int hex_value(char c){
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// copies len bytes of src to dst, decoding escapes of unreserved characters
+// and uppercasing the hex digits of all others, returns the output length
+static int normalize_escapes(char* dst, const char* src, int len){
+    int i;
+    int n = 0;
+    int hi, lo;
+    char c;
+
+    for(i = 0; i < len; i++){
+        if(src[i] == '%' && i + 2 < len &&
+           (hi = hex_value(src[i+1])) >= 0 &&
+           (lo = hex_value(src[i+2])) >= 0){
+            c = (char)(hi * 16 + lo);
+            if(isalnum((unsigned char)c) || strchr("-._~", c) != NULL){
+                dst[n++] = c;
+            }
+            else{
+                n += sprintf(&dst[n], "%%%02X", (unsigned char)c);
+            }
+            i += 2;
+        }
+        else{
+            dst[n++] = src[i];
+        }
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+static int compare_params(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// returns 1 if the query parameter param ("name" or "name=value") is one of
+// the parameters configured to be dropped
+static int stripped(const char* param){
+    char name[MAX_URL];
+    int n = strcspn(param, "=");
+
+    if(strip_list[0] == '\0' || n > MAX_URL - 3) return 0;
+    sprintf(name, ",%.*s,", n, param);
+    return strstr(strip_list, name) != NULL;
+}
+
+// normalizes a query string (without the '?') into dst, returns its length
+static int normalize_query(char* dst, const char* query){
+    char buf[MAX_URL];
+    char* params[MAX_PARAMS];
+    char* save;
+    char* param;
+    int count = 0;
+    int n = 0;
+    int i;
+
+    normalize_escapes(buf, query, strlen(query));
+    for(param = strtok_r(buf, "&", &save); param != NULL;
+        param = strtok_r(NULL, "&", &save)){
+        if(stripped(param)) continue;
+        if(count == MAX_PARAMS) return -1;
+        params[count++] = param;
+    }
+    if(sort_query) qsort(params, count, sizeof(char*), compare_params);
+
+    for(i = 0; i < count; i++){
+        n += sprintf(&dst[n], "%s%s", (i == 0) ? "" : "&", params[i]);
+    }
+    return n;
+}
+
+// whether the n bytes left at p are exactly, or start with, s
+static int dots_are(const char* p, int n, const char* s){
+    return n == strlen(s) && !strncmp(p, s, n);
+}
+
+static int dots_start(const char* p, int n, const char* s){
+    return n >= strlen(s) && !strncmp(p, s, strlen(s));
+}
+
+int key_remove_dots(char* path, int len){
+    int i = 0;                          // input read so far
+    int n = 0;                          // output written, never ahead of i
+
+    while(i < len){
+        if(dots_start(path + i, len - i, "../")) i += 3;
+        else if(dots_start(path + i, len - i, "./")) i += 2;
+        else if(dots_start(path + i, len - i, "/./")) i += 2;
+        else if(dots_are(path + i, len - i, "/.")){
+            path[n++] = '/';
+            i = len;
+        }
+        else if(dots_start(path + i, len - i, "/../") ||
+                dots_are(path + i, len - i, "/..")){
+            // goes up past the last segment written
+            while(n > 0 && path[n-1] != '/') n--;
+            if(n > 0) n--;
+            if(i + 3 == len){
+                path[n++] = '/';
+                i = len;
+            }
+            else{
+                i += 3;
+            }
+        }
+        else if(dots_are(path + i, len - i, ".") ||
+                dots_are(path + i, len - i, "..")){
+            i = len;
+        }
+        else{
+            // the next segment, with the '/' before it, is kept
+            path[n++] = path[i++];
+            while(i < len && path[i] != '/') path[n++] = path[i++];
+        }
+    }
+    path[n] = '\0';
+    return n;
+}
+
+int key_url(char* url, int size, const char* host, int port,
+            const char* path){
+    char buf[2*MAX_URL];
+    char query[MAX_URL];
+    int host_len = strlen(host);
+    int path_len = strcspn(path, "?#");
+    int n = 0;
+    int i;
+    int len;
+
+    if(host_len + path_len + 16 > MAX_URL || strlen(path) >= MAX_URL){
+        return -1;
+    }
+
+    // hosts are case insensitive and may carry a trailing dot
+    if(host_len > 0 && host[host_len-1] == '.') host_len--;
+    for(i = 0; i < host_len; i++) buf[n++] = tolower((unsigned char)host[i]);
+    n += sprintf(&buf[n], ":%d", port);
+
+    if(path_len == 0) buf[n++] = '/';
+    len = normalize_escapes(&buf[n], path, path_len);
+    n += key_remove_dots(&buf[n], len);
+
+    // the fragment never reaches the server, only the query matters
+    if(path[path_len] == '?'){
+        strcpy(query, &path[path_len+1]);
+        query[strcspn(query, "#")] = '\0';
+        buf[n++] = '?';
+        if((i = normalize_query(&buf[n], query)) < 0) return -1;
+        n += i;
+        if(i == 0) n--;     // every parameter was stripped
+    }
+    buf[n] = '\0';
+
+    if(n >= size) return -1;
+    memcpy(url, buf, n+1);
+    return n;
+}
+
+url_key key_request(const char* host, int port, const char* path){
+    char url[MAX_URL];
+    url_key key;
+    int len;
+
+    // a URL too long to normalize still gets a key of its own
+    if((len = key_url(url, MAX_URL, host, port, path)) < 0){
+        key.hash = key_hash(path, strlen(path),
+                            key_hash(host, strlen(host), 0));
+        key.check = key_hash(path, strlen(path),
+                             key_hash(host, strlen(host), KEY_CHECK_SEED));
+        return key;
+    }
+    key.hash = key_hash(url, len, 0);
+    key.check = key_hash(url, len, KEY_CHECK_SEED);
+    return key;
+}
+
+int key_vary(char* vary, int size, const char* value){
+    int n = 0;
+    int len;
+    const char* p = value;
+
+    while(*p != '\0'){
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        len = strcspn(p, " \t,");
+        if(len == 0) break;
+        if(len == 1 && *p == '*') return -1;
+        if(n + len + 2 > size) return -1;
+
+        if(n > 0) vary[n++] = ',';
+        while(len-- > 0) vary[n++] = tolower((unsigned char)*p++);
+    }
+    vary[n] = '\0';
+    return n;
+}
+
+// finds the value of header name in a block of "Name: value\r\n" lines,
+// returns a pointer to it and stores its length in len, or NULL if missing
+static const char* find_header(const char* header, const char* name,
+                               int name_len, int* len){
+    const char* p = header;
+    const char* eol;
+
+    while(*p != '\0'){
+        eol = p + strcspn(p, "\r\n");
+        if(eol - p > name_len && p[name_len] == ':' &&
+           !strncasecmp(p, name, name_len)){
+            p += name_len + 1;
+            while(p < eol && (*p == ' ' || *p == '\t')) p++;
+            *len = eol - p;
+            while(*len > 0 && (p[*len-1] == ' ' || p[*len-1] == '\t')){
+                (*len)--;
+            }
+            return p;
+        }
+        p = eol + strspn(eol, "\r\n");
+    }
+    return NULL;
+}
+
+uint64_t key_variant(const char* vary, const char* header){
+    uint64_t h = 0;
+    const char* name = vary;
+    const char* value;
+    int name_len;
+    int len;
+
+    if(vary[0] == '\0') return 0;
+
+    // a missing header hashes differently from an empty one
+    while(*name != '\0'){
+        name_len = strcspn(name, ",");
+        h = key_hash(name, name_len, h);
+        if((value = find_header(header, name, name_len, &len)) != NULL){
+            h = key_hash(value, len, h + 1);
+        }
+        name += name_len;
+        if(*name == ',') name++;
+    }
+    return h ? h : 1;
+}
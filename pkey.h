@@ -0,0 +1,49 @@
+#ifndef PKEY_H_
+#define PKEY_H_
+
+#include <stdint.h>
+
+#define MAX_URL 8192
+// seeds the second hash of a URL, independent of the one it is found by
+#define KEY_CHECK_SEED 0x9e3779b97f4a7c15ULL
+
+// a URL's cache key: objects are found by hash, and check, a second hash
+// of the same URL, tells apart two URLs whose hashes collide
+typedef struct url_key
+{
+    uint64_t hash;
+    uint64_t check;
+} url_key;
+
+// sets how query strings are normalized: sort_query puts parameters in a
+// fixed order and strip is a comma separated list of parameter names (e.g.
+// tracking parameters) to drop, or NULL
+void key_init(int sort_query, const char* strip);
+
+// removes the "." and ".." segments from the len byte path in place, as
+// RFC 3986 5.2.4 does when resolving a reference, returns the new length
+int key_remove_dots(char* path, int len);
+
+// writes the canonical form of a URL to url: lowercased host, explicit port,
+// normalized percent-encoding, no dot segments in the path, normalized
+// query string, and no fragment
+// returns the length of the canonical URL or -1 if it doesn't fit
+int key_url(char* url, int size, const char* host, int port,
+            const char* path);
+
+// returns the cache key for a URL, two hashes of its canonical form
+url_key key_request(const char* host, int port, const char* path);
+
+// normalizes the value of a Vary header into a lowercased, comma separated
+// list of header names, returns -1 if the response can't be cached by
+// variant (Vary: * or too many names)
+int key_vary(char* vary, int size, const char* value);
+
+// returns the hash picking out a request's variant of a response whose
+// Vary list is vary, given the request's headers
+uint64_t key_variant(const char* vary, const char* header);
+
+// 64 bit hash of len bytes of data
+uint64_t key_hash(const void* data, int len, uint64_t seed);
+
+#endif
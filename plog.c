@@ -0,0 +1,150 @@
+#include "csapp.h"
+#include "pstats.h"
+#include "plog.h"
+
+#define CACHE_LINE 64
+
+// a single producer, single consumer queue: the thread owning the ring
+// only moves tail and the writer only moves head, each on a cache line of
+// its own
+typedef struct log_ring
+{
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    int owned __attribute__((aligned(CACHE_LINE)));
+    log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static const char* results[] = {
+    "MISS", "HIT", "STALE", "REVALIDATED", "PEER", "ERROR", "TUNNEL"
+};
+
+static log_ring* rings = NULL;
+static int ring_count = 0;              // rings to hand out, the shared one
+                                        // follows them
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_ring = 0;      // where the next claim starts looking
+static int log_fd = -1;
+static pthread_key_t ring_key;
+static __thread log_ring* ring = NULL;
+
+// hands a thread's ring back when the thread ends, whatever is still in it
+// is written out by the writer as usual
+static void release_ring(void* vargp){
+    log_ring* r = vargp;
+
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+    return;
+}
+
+// finds a free ring for the calling thread, the shared one if there is none
+// short lived threads each start looking one ring further along, rather
+// than all taking turns filling the first one between two drains
+static log_ring* claim_ring(){
+    unsigned int start;
+    log_ring* r;
+    int expected;
+    int i;
+
+    start = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED);
+    for(i = 0; i < ring_count; i++){
+        r = &rings[(start + i) % ring_count];
+        expected = 0;
+        if(__atomic_load_n(&r->owned, __ATOMIC_RELAXED) == 0 &&
+           __atomic_compare_exchange_n(&r->owned, &expected, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            pthread_setspecific(ring_key, r);
+            return r;
+        }
+    }
+    return &rings[ring_count];
+}
+
+// appends one record to buf as a line, returns its length
+static int format_record(char* buf, const log_record* r){
+    char client[INET_ADDRSTRLEN];
+    struct in_addr addr;
+
+    addr.s_addr = r->client;
+    inet_ntop(AF_INET, &addr, client, INET_ADDRSTRLEN);
+    return sprintf(buf, "%lu.%06lu %s %ld %s %d %s %lu\n",
+                   (unsigned long)(r->time / 1000000),
+                   (unsigned long)(r->time % 1000000), r->url, r->bytes,
+                   client, r->status, results[r->result],
+                   (unsigned long)r->duration);
+}
+
+// drains every ring into large writes, sleeping while they are all empty
+static void* log_writer(void* vargp){
+    char* buf = Malloc(LOG_BATCH);
+    unsigned long head;
+    unsigned long tail;
+    int len = 0;
+    int i;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        for(i = 0; i <= ring_count; i++){
+            head = rings[i].head;
+            tail = __atomic_load_n(&rings[i].tail, __ATOMIC_ACQUIRE);
+            for(; head != tail; head++){
+                if(len > LOG_BATCH - (int)sizeof(log_record) - MAXBUF/8){
+                    rio_writen(log_fd, buf, len);
+                    len = 0;
+                }
+                len += format_record(buf + len,
+                                     &rings[i].records[head % LOG_RING_SIZE]);
+            }
+            __atomic_store_n(&rings[i].head, head, __ATOMIC_RELEASE);
+        }
+
+        if(len > 0){
+            rio_writen(log_fd, buf, len);
+            len = 0;
+        }
+        else{
+            usleep(LOG_IDLE);
+        }
+    }
+    return NULL;
+}
+
+int log_init(const char* file, int threads){
+    pthread_t tid;
+
+    if((log_fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0){
+        return -1;
+    }
+    ring_count = threads;
+    rings = Calloc(ring_count + 1, sizeof(log_ring));
+    pthread_key_create(&ring_key, release_ring);
+    Pthread_create(&tid, NULL, log_writer, NULL);
+    return 0;
+}
+
+int log_request(const log_record* r){
+    log_ring* shared;
+    unsigned long tail;
+    int queued = 1;
+
+    if(rings == NULL) return 0;
+    if(ring == NULL) ring = claim_ring();
+
+    // the threads sharing a ring take turns producing into it
+    shared = &rings[ring_count];
+    if(ring == shared) pthread_mutex_lock(&shared_lock);
+
+    // never wait for the writer, a full ring loses the record
+    tail = ring->tail;
+    if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+       LOG_RING_SIZE){
+        stats_inc(STAT_LOG_DROPPED);
+        queued = 0;
+    }
+    else{
+        ring->records[tail % LOG_RING_SIZE] = *r;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    if(ring == shared) pthread_mutex_unlock(&shared_lock);
+    return queued;
+}
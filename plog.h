@@ -0,0 +1,52 @@
+#ifndef PLOG_H_
+#define PLOG_H_
+
+#include <stdint.h>
+
+#define LOG_FILE "proxy.log"
+// longest URL kept in a record, longer ones are cut short
+#define LOG_URL 200
+// records each ring holds, a thread whose ring is full drops its records
+#define LOG_RING_SIZE 64
+// the writer batches records into writes of up to this many bytes
+#define LOG_BATCH 65536
+// how long the writer sleeps when every ring is empty, in microseconds
+#define LOG_IDLE 5000
+
+// how a request was answered
+enum log_result
+{
+    LOG_MISS,                           // fetched from the origin
+    LOG_HIT,                            // fresh copy from the cache
+    LOG_STALE,                          // stale copy from the cache
+    LOG_REVALIDATED,                    // cached copy the origin confirmed
+    LOG_PEER,                           // forwarded to the owning peer
+    LOG_ERROR,                          // the origin couldn't be reached
+    LOG_TUNNEL                          // a CONNECT tunnel
+};
+
+// one line of the access log
+typedef struct log_record
+{
+    uint64_t time;                      // when the request arrived, in us
+    uint64_t duration;                  // us
+    long bytes;                         // sent to the client
+    uint32_t client;                    // IPv4 address, network order
+    int status;
+    int result;                         // a log_result
+    char url[LOG_URL];
+} log_record;
+
+// opens the log and starts the thread writing it, with a ring for each of
+// up to threads threads logging at once, any more share one ring under a
+// lock, returns -1 if the file can't be opened
+// the log is written as lines of
+//   time url bytes client status result duration_us
+// so that replay can read it as a trace
+int log_init(const char* file, int threads);
+
+// queues a record for the writer without blocking, unless the thread
+// shares a ring, returns 0 if it was dropped because the ring is full
+int log_request(const log_record* r);
+
+#endif
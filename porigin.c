@@ -0,0 +1,220 @@
+#include "csapp.h"
+#include "pkey.h"
+#include "pstats.h"
+#include "porigin.h"
+
+enum breaker
+{
+    BREAKER_CLOSED,                     // requests go through
+    BREAKER_TRIPPED,                    // requests fail fast
+    BREAKER_PROBING                     // one request is finding out
+};
+
+typedef struct origin
+{
+    uint64_t hash;
+    char name[ORIGIN_NAME];
+    int used;
+    int inflight;
+    int waiting;
+    int breaker;
+    int failures;                       // in a row
+    uint64_t open_until;
+    uint64_t last_used;                 // for picking a slot to reuse
+    pthread_cond_t freed;               // a request in flight finished
+} origin;
+
+static origin table[ORIGINS];
+static int concurrency = ORIGIN_CONCURRENCY;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t held;              // origin + 1 the thread is in
+static pthread_once_t held_once = PTHREAD_ONCE_INIT;
+
+// whether table[i] can be handed to another origin, nothing is using or
+// waiting on it and its breaker is closed, so at most a few failures short
+// of opening it are forgotten
+static int idle(int i){
+    origin* o = &table[i];
+
+    return o->inflight == 0 && o->waiting == 0 &&
+           o->breaker == BREAKER_CLOSED;
+}
+
+// finds host:port in the table, adding it if it is new, with mutex held,
+// returns -1 if none of its slots is free or idle
+// an origin is only kept in one of the ORIGIN_WAYS slots from where its
+// name hashes to, so a lookup never looks further, a new one takes the
+// first free slot or else the least recently used idle one
+static int lookup(const char* name){
+    uint64_t hash = key_hash(name, strlen(name), 0);
+    int reuse = -1;
+    int i, n;
+
+    for(n = 0; n < ORIGIN_WAYS; n++){
+        i = (hash + n) % ORIGINS;
+        if(!table[i].used){
+            table[i].used = 1;
+            pthread_cond_init(&table[i].freed, NULL);
+            reuse = i;
+            break;
+        }
+        if(table[i].hash == hash && strcmp(table[i].name, name) == 0){
+            table[i].last_used = stats_clock();
+            return i;
+        }
+        if(idle(i) &&
+           (reuse < 0 || table[i].last_used < table[reuse].last_used)){
+            reuse = i;
+        }
+    }
+    if(reuse < 0){
+        stats_inc(STAT_ORIGINS_UNTRACKED);
+        return -1;
+    }
+
+    table[reuse].hash = hash;
+    snprintf(table[reuse].name, ORIGIN_NAME, "%s", name);
+    table[reuse].failures = 0;
+    table[reuse].last_used = stats_clock();
+    return reuse;
+}
+
+// ends a request to table[i] with mutex held, ok is 1 if the origin
+// answered, 0 if it failed and -1 if it isn't known
+static void release(int i, int ok){
+    origin* o = &table[i];
+
+    o->inflight--;
+    pthread_cond_signal(&o->freed);
+
+    if(ok == 1){
+        o->failures = 0;
+        o->breaker = BREAKER_CLOSED;
+    }
+    else if(ok == 0){
+        o->failures++;
+        if(o->breaker == BREAKER_PROBING ||
+           (o->breaker == BREAKER_CLOSED &&
+            o->failures >= BREAKER_FAILURES)){
+            if(o->breaker == BREAKER_CLOSED) stats_inc(STAT_BREAKER_OPENED);
+            o->breaker = BREAKER_TRIPPED;
+            o->open_until = stats_clock() + BREAKER_OPEN;
+        }
+    }
+    // a probe that never finished leaves room for another
+    else if(o->breaker == BREAKER_PROBING){
+        o->breaker = BREAKER_TRIPPED;
+        o->open_until = 0;
+    }
+    return;
+}
+
+// a thread ended through the p_Rio wrappers while in an origin
+static void thread_gone(void* value){
+    pthread_mutex_lock(&mutex);
+    release((long)value - 1, -1);
+    pthread_mutex_unlock(&mutex);
+    return;
+}
+
+static void make_key(){
+    pthread_key_create(&held, thread_gone);
+}
+
+void origin_init(int n){
+    concurrency = n;
+    pthread_once(&held_once, make_key);
+    return;
+}
+
+int origin_enter(const char* host, int port, int* id){
+    char name[ORIGIN_NAME];
+    struct timespec until;
+    uint64_t now = stats_clock();
+    uint64_t wait_end;
+    origin* o;
+    int i;
+
+    pthread_once(&held_once, make_key);
+    snprintf(name, ORIGIN_NAME, "%s:%d", host, port);
+    *id = -1;
+
+    pthread_mutex_lock(&mutex);
+    if((i = lookup(name)) < 0){
+        pthread_mutex_unlock(&mutex);
+        return ORIGIN_OK;
+    }
+    o = &table[i];
+
+    // once the breaker has been open long enough, the next request through
+    // probes the origin while the rest keep failing fast
+    if(o->breaker == BREAKER_TRIPPED && now >= o->open_until){
+        o->breaker = BREAKER_PROBING;
+    }
+    else if(o->breaker != BREAKER_CLOSED){
+        pthread_mutex_unlock(&mutex);
+        stats_inc(STAT_BREAKER_REJECTED);
+        return ORIGIN_BROKEN;
+    }
+
+    if(o->inflight >= concurrency){
+        if(o->waiting >= ORIGIN_QUEUE){
+            pthread_mutex_unlock(&mutex);
+            stats_inc(STAT_ORIGIN_BUSY);
+            return ORIGIN_BUSY;
+        }
+
+        // the condition variable waits on the realtime clock
+        clock_gettime(CLOCK_REALTIME, &until);
+        wait_end = until.tv_sec * 1000000ULL + until.tv_nsec / 1000 +
+                   ORIGIN_WAIT;
+        until.tv_sec = wait_end / 1000000;
+        until.tv_nsec = wait_end % 1000000 * 1000;
+
+        o->waiting++;
+        while(o->inflight >= concurrency &&
+              pthread_cond_timedwait(&o->freed, &mutex, &until) == 0);
+        o->waiting--;
+        if(o->inflight >= concurrency){
+            if(o->breaker == BREAKER_PROBING){
+                o->breaker = BREAKER_TRIPPED;
+                o->open_until = 0;
+            }
+            pthread_mutex_unlock(&mutex);
+            stats_inc(STAT_ORIGIN_BUSY);
+            return ORIGIN_BUSY;
+        }
+    }
+    o->inflight++;
+    pthread_setspecific(held, (void*)(long)(i + 1));
+    pthread_mutex_unlock(&mutex);
+
+    *id = i;
+    return ORIGIN_OK;
+}
+
+int origin_load(const char* host, int port){
+    char name[ORIGIN_NAME];
+    int load = 0;
+    int i;
+
+    snprintf(name, ORIGIN_NAME, "%s:%d", host, port);
+    pthread_mutex_lock(&mutex);
+    if((i = lookup(name)) >= 0){
+        load = table[i].inflight;
+        if(table[i].breaker != BREAKER_CLOSED){
+            load = concurrency + ORIGIN_QUEUE;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return load;
+}
+
+void origin_leave(int id, int ok){
+    if(id < 0) return;
+    pthread_mutex_lock(&mutex);
+    pthread_setspecific(held, NULL);
+    release(id, ok);
+    pthread_mutex_unlock(&mutex);
+    return;
+}
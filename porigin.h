@@ -0,0 +1,54 @@
+#ifndef PORIGIN_H_
+#define PORIGIN_H_
+
+// keeps one slow or failing origin from tying up every thread: each
+// origin (host:port) may have only so many requests in flight, the next
+// ones queue for a while and are then turned away, and a circuit breaker
+// fails requests fast once an origin has failed BREAKER_FAILURES times in
+// a row, letting a single probe through every BREAKER_OPEN to see whether
+// it is back
+// the limits are per worker process
+
+// origins tracked, an origin with nothing in flight and its breaker
+// closed gives up its slot to a new one, any more go unlimited
+#define ORIGINS 1024
+// slots an origin may be kept in, starting from the one its name hashes to
+#define ORIGIN_WAYS 16
+// longest host:port tracked
+#define ORIGIN_NAME 256
+// default for the most requests in flight to one origin
+#define ORIGIN_CONCURRENCY 32
+// most requests queued for one origin, any more are turned away
+#define ORIGIN_QUEUE 64
+// how long a request queues for its origin, in microseconds
+#define ORIGIN_WAIT 2000000
+// failed connects or timeouts in a row that open the breaker
+#define BREAKER_FAILURES 5
+// how long the breaker stays open before probing, in microseconds
+#define BREAKER_OPEN 10000000
+
+enum origin_status
+{
+    ORIGIN_OK,                          // go ahead, then call origin_leave
+    ORIGIN_BUSY,                        // too many requests in flight
+    ORIGIN_BROKEN                       // the breaker is open
+};
+
+// sets the most requests in flight to one origin
+void origin_init(int concurrency);
+
+// asks to send a request to host:port, waiting for a turn if it has too
+// many in flight, on ORIGIN_OK sets origin for origin_leave
+// a thread that exits before calling origin_leave gives its turn back,
+// without it counting for or against the origin
+int origin_enter(const char* host, int port, int* origin);
+
+// ends a request origin_enter let through, ok says whether the origin
+// answered, or failed to connect or timed out
+void origin_leave(int origin, int ok);
+
+// the number of requests in flight to host:port, or ORIGIN_QUEUE more than
+// its limit while its breaker is open, for picking the least loaded
+int origin_load(const char* host, int port);
+
+#endif
@@ -0,0 +1,175 @@
+#include "csapp.h"
+#include "pkey.h"
+#include "ppeer.h"
+
+typedef struct peer
+{
+    char host[MAXLINE];
+    int port;
+    uint32_t addrs[PEER_ADDRS];         // IPv4, network order
+    int addr_count;
+    time_t down_until;                  // failed recently, skip until then
+    int idle[PEER_POOL];                // connections ready for a request
+    int idle_count;
+    pthread_mutex_t lock;
+} peer;
+
+typedef struct point
+{
+    uint64_t hash;
+    int peer;
+} point;
+
+static peer peers[MAX_PEERS];
+static int peer_count = 0;
+static int self_index = -1;
+static point ring[MAX_PEERS * PEER_VNODES];
+static int ring_size = 0;
+
+// looks up the addresses of a peer's name, a name that doesn't resolve
+// leaves the peer with none, so none of its requests are trusted
+static void resolve_peer(peer* p){
+    struct addrinfo hints, *list, *a;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    p->addr_count = 0;
+    if(getaddrinfo(p->host, NULL, &hints, &list) != 0) return;
+    for(a = list; a != NULL && p->addr_count < PEER_ADDRS; a = a->ai_next){
+        p->addrs[p->addr_count++] =
+            ((struct sockaddr_in*)a->ai_addr)->sin_addr.s_addr;
+    }
+    freeaddrinfo(list);
+    return;
+}
+
+static int compare_points(const void* a, const void* b){
+    const point* x = a;
+    const point* y = b;
+
+    if(x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+    return x->peer - y->peer;
+}
+
+int peer_init(const char* members, const char* self){
+    char list[MAXLINE];
+    char name[MAXLINE];
+    char* save;
+    char* member;
+    char* colon;
+    int i, v, len;
+
+    if(strlen(members) >= MAXLINE) return -1;
+    strcpy(list, members);
+
+    for(member = strtok_r(list, ",", &save); member != NULL;
+        member = strtok_r(NULL, ",", &save)){
+        if(peer_count == MAX_PEERS) return -1;
+        if((colon = strrchr(member, ':')) == NULL || colon == member) return -1;
+        if(!strcmp(member, self)) self_index = peer_count;
+
+        i = peer_count++;
+        sprintf(peers[i].host, "%.*s", (int)(colon - member), member);
+        peers[i].port = atoi(colon + 1);
+        resolve_peer(&peers[i]);
+        peers[i].down_until = 0;
+        peers[i].idle_count = 0;
+        pthread_mutex_init(&peers[i].lock, NULL);
+
+        // every proxy derives the same points from the same names
+        for(v = 0; v < PEER_VNODES; v++){
+            len = sprintf(name, "%s#%d", member, v);
+            ring[ring_size].hash = key_hash(name, len, 0);
+            ring[ring_size].peer = i;
+            ring_size++;
+        }
+    }
+    if(self_index < 0) return -1;
+    qsort(ring, ring_size, sizeof(point), compare_points);
+    return 0;
+}
+
+int peer_trusted(int fd){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int i, a;
+
+    if(getpeername(fd, (SA*)&addr, &len) != 0 ||
+       addr.sin_family != AF_INET){
+        return 0;
+    }
+    for(i = 0; i < peer_count; i++){
+        for(a = 0; a < peers[i].addr_count; a++){
+            if(peers[i].addrs[a] == addr.sin_addr.s_addr) return 1;
+        }
+    }
+    return 0;
+}
+
+int peer_owner(uint64_t key){
+    int lo = 0;
+    int hi = ring_size;
+    int mid;
+    int owner;
+
+    if(peer_count < 2) return -1;
+
+    // the first point at or after the key owns it, wrapping around
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(ring[mid].hash < key) lo = mid + 1;
+        else hi = mid;
+    }
+    owner = ring[lo % ring_size].peer;
+
+    if(owner == self_index || time(NULL) < peers[owner].down_until) return -1;
+    return owner;
+}
+
+const char* peer_host(int p){
+    return peers[p].host;
+}
+
+int peer_port(int p){
+    return peers[p].port;
+}
+
+int peer_connect(int p, int timeout, int* reused){
+    int fd = -1;
+
+    pthread_mutex_lock(&peers[p].lock);
+    if(peers[p].idle_count > 0) fd = peers[p].idle[--peers[p].idle_count];
+    pthread_mutex_unlock(&peers[p].lock);
+
+    *reused = (fd >= 0);
+    if(fd < 0) fd = open_clientfd_t(peers[p].host, peers[p].port, timeout);
+    return (fd < 0) ? -1 : fd;
+}
+
+void peer_release(int p, int fd){
+    pthread_mutex_lock(&peers[p].lock);
+    if(peers[p].idle_count < PEER_POOL){
+        peers[p].idle[peers[p].idle_count++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&peers[p].lock);
+
+    if(fd >= 0) close(fd);
+    return;
+}
+
+void peer_failed(int p){
+    int fd;
+
+    pthread_mutex_lock(&peers[p].lock);
+    peers[p].down_until = time(NULL) + PEER_RETRY;
+
+    // connections to a failing peer aren't worth keeping
+    while(peers[p].idle_count > 0){
+        fd = peers[p].idle[--peers[p].idle_count];
+        close(fd);
+    }
+    pthread_mutex_unlock(&peers[p].lock);
+    return;
+}
@@ -0,0 +1,46 @@
+#ifndef PPEER_H_
+#define PPEER_H_
+
+#include <stdint.h>
+
+// most proxies in a fleet
+#define MAX_PEERS 32
+// points each proxy gets on the hash ring, more spread the keys more evenly
+#define PEER_VNODES 160
+// idle connections kept open to each peer
+#define PEER_POOL 8
+// seconds a peer that failed is skipped for before it is tried again
+#define PEER_RETRY 10
+// addresses of each peer's name kept for telling its connections apart
+#define PEER_ADDRS 4
+
+// sets up the hash ring from a comma separated list of host:port names of
+// every proxy in the fleet (the same list on each of them), self is this
+// proxy's own name in the list, returns -1 if the list is malformed or
+// doesn't include self
+int peer_init(const char* members, const char* self);
+
+// whether the connection fd comes from the address of a proxy in the
+// fleet, only those may have their requests answered as a peer's
+int peer_trusted(int fd);
+
+// returns the peer owning key, or -1 if this proxy owns it, there are no
+// peers, or the owner has failed recently
+int peer_owner(uint64_t key);
+
+// the host and port of a peer
+const char* peer_host(int peer);
+int peer_port(int peer);
+
+// returns a connection to a peer, an idle one if there is one, sets reused
+// to say which, or -1 if the peer can't be reached within timeout
+// milliseconds
+int peer_connect(int peer, int timeout, int* reused);
+
+// hands back a connection that is ready for another request
+void peer_release(int peer, int fd);
+
+// marks a peer as failed, keys it owns go to the origin for a while
+void peer_failed(int peer);
+
+#endif
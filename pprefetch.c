@@ -0,0 +1,313 @@
+#include <ctype.h>
+#include "csapp.h"
+#include "pkey.h"
+#include "pstats.h"
+#include "pprefetch.h"
+
+// a link waiting to be fetched
+typedef struct link_job
+{
+    char host[PREFETCH_NAME];
+    int port;
+    char path[PREFETCH_PATH];
+    char* header;
+} link_job;
+
+// what a host has spent of its budget since it was last renewed
+typedef struct budget
+{
+    char name[PREFETCH_NAME];           // host:port, empty if unused
+    time_t renewed;
+    int used;
+} budget;
+
+// the queue, a ring of PREFETCH_QUEUE links, and the threads taking from
+// it, and the budgets, all guarded by mutex
+static link_job* queue[PREFETCH_QUEUE];
+static int head = 0;
+static int count = 0;
+static int threads = 0;
+static int idle = 0;
+static budget budgets[PREFETCH_HOSTS];
+static int per_host = PREFETCH_BUDGET;
+static void (*fetch_link)(char* host, int port, char* path, char* header);
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+static void* prefetch_thread(void* vargp);
+
+static int word_is(const char* p, int len, const char* word){
+    return len == strlen(word) && !strncasecmp(p, word, len);
+}
+
+// takes the dot segments out of a resolved link's path, so that it is
+// fetched under the key the client's own request for it will have
+static int without_dots(char* dst){
+    char query[PREFETCH_PATH];
+    int len = strcspn(dst, "?");
+
+    strcpy(query, dst + len);
+    len = key_remove_dots(dst, len);
+    strcpy(dst + len, query);
+    return 1;
+}
+
+// resolves a link of len bytes found on the page at path to a path on the
+// page's own origin, into dst, returns 0 if it leads anywhere else or
+// doesn't fit
+static int resolve(const char* host, int port, const char* path,
+                   const char* link, int len, char* dst){
+    char ref[PREFETCH_PATH];
+    char* authority;
+    char* p;
+    int link_port = 80;
+    int n;
+
+    if(len >= PREFETCH_PATH) return 0;
+    memcpy(ref, link, len);
+    ref[len] = '\0';
+    if((p = strchr(ref, '#')) != NULL) *p = '\0';
+    if(ref[0] == '\0') return 0;
+
+    // a link naming a host must name the page's own
+    if(!strncasecmp(ref, "http://", 7) || !strncmp(ref, "//", 2)){
+        authority = strstr(ref, "//") + 2;
+        n = strcspn(authority, ":/?");
+        if(authority[n] == ':') link_port = atoi(authority + n + 1);
+        if(n != strlen(host) || strncasecmp(authority, host, n) ||
+           link_port != port){
+            return 0;
+        }
+        p = authority + strcspn(authority, "/?");
+        n = snprintf(dst, PREFETCH_PATH, "%s%s", (*p == '/') ? "" : "/", p);
+        return n < PREFETCH_PATH && without_dots(dst);
+    }
+
+    // any other scheme (https:, data:, mailto:, ...) is out of reach
+    if(ref[strcspn(ref, ":/?")] == ':') return 0;
+    if(ref[0] == '/'){
+        n = snprintf(dst, PREFETCH_PATH, "%s", ref);
+        return n < PREFETCH_PATH && without_dots(dst);
+    }
+
+    // relative to the page's directory
+    n = strcspn(path, "?");
+    while(n > 0 && path[n-1] != '/') n--;
+    if(n + strlen(ref) >= PREFETCH_PATH) return 0;
+    sprintf(dst, "%.*s%s", n, path, ref);
+    return without_dots(dst);
+}
+
+// finds the links worth prefetching in html, resolved and without
+// repeats, returns how many of them fit in links
+static int find_links(const char* host, int port, const char* path,
+                      const char* html, int len,
+                      char links[][PREFETCH_PATH], int max){
+    const char* end = html + len;
+    const char* p = html;
+    const char* tag;
+    const char* name;
+    const char* value;
+    int tag_len;
+    int name_len;
+    int value_len;
+    char quote;
+    int n = 0;
+    int i;
+
+    while(n < max && p < end && (p = memchr(p, '<', end - p)) != NULL){
+        tag = ++p;
+        while(p < end && isalnum((unsigned char)*p)) p++;
+        tag_len = p - tag;
+
+        // comments, closing tags and the like have no links
+        if(tag_len == 0) continue;
+
+        while(n < max && p < end && *p != '>'){
+            if(isspace((unsigned char)*p) || *p == '/'){
+                p++;
+                continue;
+            }
+            name = p;
+            while(p < end && !isspace((unsigned char)*p) && *p != '=' &&
+                  *p != '>'){
+                p++;
+            }
+            name_len = p - name;
+            while(p < end && isspace((unsigned char)*p)) p++;
+            if(p == end || *p != '=') continue;
+            p++;
+            while(p < end && isspace((unsigned char)*p)) p++;
+
+            if(p < end && (*p == '"' || *p == '\'')){
+                quote = *p++;
+                value = p;
+                while(p < end && *p != quote) p++;
+                value_len = p - value;
+                if(p < end) p++;
+            }
+            else{
+                value = p;
+                while(p < end && !isspace((unsigned char)*p) && *p != '>'){
+                    p++;
+                }
+                value_len = p - value;
+            }
+
+            // src of images, scripts and frames, href only of <link>,
+            // a page's <a> links may never be followed
+            if(!word_is(name, name_len, "src") &&
+               !(word_is(tag, tag_len, "link") &&
+                 word_is(name, name_len, "href"))){
+                continue;
+            }
+            if(!resolve(host, port, path, value, value_len, links[n]) ||
+               !strcmp(links[n], path)){
+                continue;
+            }
+            for(i = 0; i < n; i++){
+                if(!strcmp(links[i], links[n])) break;
+            }
+            if(i == n) n++;
+        }
+    }
+    return n;
+}
+
+// takes a link's worth of a host's budget, called with mutex held,
+// returns 0 if the budget is spent
+static int spend(const char* name){
+    uint32_t hash = 2166136261u;
+    time_t now = time(NULL);
+    budget* b = NULL;
+    budget* stale = NULL;
+    const char* p;
+    int i;
+
+    for(p = name; *p != '\0'; p++){
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    // a slot whose period is over holds nothing worth keeping,
+    // so another host may take it once the probe finds no match
+    for(i = 0; i < PREFETCH_HOSTS; i++){
+        b = &budgets[(hash + i) % PREFETCH_HOSTS];
+        if(b->name[0] == '\0' || !strcmp(b->name, name)) break;
+        if(stale == NULL && now - b->renewed >= PREFETCH_PERIOD) stale = b;
+    }
+    if(i == PREFETCH_HOSTS || b->name[0] == '\0'){
+        if(stale != NULL) b = stale;
+        else if(i == PREFETCH_HOSTS){
+            stats_inc(STAT_PREFETCH_BUDGET_FULL);
+            return 0;
+        }
+        strcpy(b->name, name);
+        b->renewed = now;
+        b->used = 0;
+    }
+
+    if(now - b->renewed >= PREFETCH_PERIOD){
+        b->renewed = now;
+        b->used = 0;
+    }
+    if(b->used >= per_host) return 0;
+    b->used++;
+    return 1;
+}
+
+// starts another thread, called with mutex held, a failure leaves the
+// links queued for the threads already running
+static void add_thread(){
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, prefetch_thread, NULL) == 0) threads++;
+    return;
+}
+
+static link_job* take(){
+    link_job* job;
+
+    pthread_mutex_lock(&mutex);
+    idle++;
+    while(count == 0) pthread_cond_wait(&ready, &mutex);
+    idle--;
+    job = queue[head];
+    head = (head + 1) % PREFETCH_QUEUE;
+    count--;
+    pthread_mutex_unlock(&mutex);
+    return job;
+}
+
+static void free_job(void* vargp){
+    link_job* job = (link_job*)vargp;
+
+    free(job->header);
+    free(job);
+    return;
+}
+
+// the p_Rio wrappers end a thread whose connection fails, its place goes
+// to a new one if links are still waiting
+static void thread_gone(void* vargp){
+    pthread_mutex_lock(&mutex);
+    threads--;
+    if(count > idle) add_thread();
+    pthread_mutex_unlock(&mutex);
+    return;
+}
+
+static void* prefetch_thread(void* vargp){
+    link_job* job;
+
+    Pthread_detach(Pthread_self());
+    pthread_cleanup_push(thread_gone, NULL);
+    while(1){
+        job = take();
+        pthread_cleanup_push(free_job, job);
+        fetch_link(job->host, job->port, job->path, job->header);
+        pthread_cleanup_pop(1);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+void prefetch_init(int budget,
+                   void (*fetch)(char* host, int port, char* path,
+                                 char* header)){
+    per_host = budget;
+    fetch_link = fetch;
+    return;
+}
+
+int prefetch_page(const char* host, int port, const char* path,
+                  const char* header, const char* html, int len){
+    char links[PREFETCH_LINKS][PREFETCH_PATH];
+    char name[PREFETCH_NAME];
+    link_job* job;
+    int queued = 0;
+    int n;
+
+    if(fetch_link == NULL || strlen(host) >= PREFETCH_NAME - 8) return 0;
+    n = find_links(host, port, path, html, len, links, PREFETCH_LINKS);
+    if(n == 0) return 0;
+    sprintf(name, "%s:%d", host, port);
+
+    pthread_mutex_lock(&mutex);
+    while(queued < n && count < PREFETCH_QUEUE && spend(name)){
+        if((job = malloc(sizeof(link_job))) == NULL) break;
+        if((job->header = strdup(header)) == NULL){
+            free(job);
+            break;
+        }
+        strcpy(job->host, host);
+        job->port = port;
+        strcpy(job->path, links[queued]);
+        queue[(head + count) % PREFETCH_QUEUE] = job;
+        count++;
+        queued++;
+        if(count > idle && threads < PREFETCH_THREADS) add_thread();
+        pthread_cond_signal(&ready);
+    }
+    pthread_mutex_unlock(&mutex);
+    if(queued < n) stats_add(STAT_PREFETCH_DROPPED, n - queued);
+    return queued;
+}
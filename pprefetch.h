@@ -0,0 +1,44 @@
+#ifndef PPREFETCH_H_
+#define PPREFETCH_H_
+
+// prefetching: a client that gets an HTML page goes on to ask for what the
+// page embeds, so a page on its way into the cache is scanned for links
+// to resources on its own origin (src= of any tag, href= of <link> tags),
+// and those are fetched into the cache in the background, ahead of the
+// client asking
+// the fetching is done by a pool of at most PREFETCH_THREADS threads from
+// a queue of PREFETCH_QUEUE links, and each host may only have its budget
+// of links queued every PREFETCH_PERIOD, links that don't fit are dropped
+// the pool and the budgets are per worker process
+
+// threads fetching links, started as they are needed and kept
+#define PREFETCH_THREADS 4
+// links waiting for a thread
+#define PREFETCH_QUEUE 64
+// most links taken from one page
+#define PREFETCH_LINKS 16
+// hosts whose budgets are kept, a slot idle for a whole period is
+// handed to another host, pages on any more aren't prefetched for
+#define PREFETCH_HOSTS 256
+// longest host and path of a link
+#define PREFETCH_NAME 256
+#define PREFETCH_PATH 2048
+// how often budgets are renewed, in seconds
+#define PREFETCH_PERIOD 60
+// default budget, links per host per period
+#define PREFETCH_BUDGET 64
+
+// sets each host's budget and what fetches a link, fetch is called on a
+// pool thread with the page's host and port, the link's path and the
+// headers of the request for the page, and must leave them unchanged
+void prefetch_init(int budget,
+                   void (*fetch)(char* host, int port, char* path,
+                                 char* header));
+
+// queues the links in html, the len byte body of the page at path on
+// host:port, for fetching as far as the host's budget goes, returns how
+// many were queued
+int prefetch_page(const char* host, int port, const char* path,
+                  const char* header, const char* html, int len);
+
+#endif
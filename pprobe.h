@@ -0,0 +1,38 @@
+#ifndef PPROBE_H_
+#define PPROBE_H_
+
+// USDT static tracepoints for bpftrace, perf and SystemTap, in the "proxy"
+// provider. They are only compiled in with PROXY_PROBES (make PROBES=1),
+// which needs <sys/sdt.h>, otherwise they vanish and their arguments are
+// never evaluated. bpf/ has scripts that attach to them.
+//
+//   request__accept(fd)                     a client connected
+//   request__parsed(host, port, path)       request head read
+//   request__done(keep)                     response sent
+//   cache__hit(key, stale)                  served from the cache
+//   cache__miss(key)                        not in the cache, or stale
+//   cache__add(key, size)                   object stored
+//   cache__evict(key, size)                 object pushed out to make room
+//   upstream__connect__start(host, port)
+//   upstream__connect__done(fd)             fd is -1 if it failed
+//   upstream__first__byte(head_len)         -1 if no response head came
+//   relay__done(key)                        origin response passed on
+//   tunnel__done(sent, received)            CONNECT tunnel closed
+//
+// a connection is served by a single thread, so scripts can match up the
+// probes of a request by tid
+
+#ifdef PROXY_PROBES
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(proxy, name)
+#define PROBE1(name, a) DTRACE_PROBE1(proxy, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#else
+#define PROBE(name) do{}while(0)
+#define PROBE1(name, a) do{}while(0)
+#define PROBE2(name, a, b) do{}while(0)
+#define PROBE3(name, a, b, c) do{}while(0)
+#endif
+
+#endif
@@ -11,18 +11,72 @@
  * It provides functions to add/remove from a linked-list style cache
  * To decide what objects remain in the cache, we have implemented a least 
  * recently used system to remove less frequently accesed data from the cache
+ *
+ * The cache lives in a shared memory region, so with -w the proxy can run
+ * several worker processes that all use it, a worker that crashes is
+ * replaced without the others or the cache going down with it
  * 
  *
  */
 
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "csapp.h"
 #include "pcache.h"
+#include "phttp.h"
+#include "pkey.h"
+#include "pzip.h"
+#include "ppeer.h"
+#include "pstats.h"
+#include "plog.h"
+#include "pprobe.h"
+#include "padmit.h"
+#include "pdeadline.h"
+#include "porigin.h"
+#include "pbackend.h"
+#include "ptunnel.h"
+#include "pbloom.h"
+#include "pprefetch.h"
 
 // Recommended max cache and object sizes 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
  // 8kb is the max header size accepted by Apache servers
 #define MAX_HEADER_SIZE 8192  
+// how long a response with no explicit freshness information stays fresh
+#define DEFAULT_TTL 300
+// most ranges a single request may ask for, and the separator between
+// them in a multipart/byteranges response
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "3d6b6a416f9b5e21"
+// a head generated for a cached response, the stored head with the fields
+// added on the way out
+#define MAX_HIT_HEAD (MAX_HEADER_SIZE + 2*MAXLINE)
+// most header fields a 304 may update a cached head with
+#define MAX_FIELDS 256
+// a multipart/byteranges part's own header
+#define MAX_PART_HEAD 320
+// with the cache kept in a file (-f), hits with bodies of at least this
+// many bytes are sent with sendfile, smaller ones are cheaper to write out
+// in one go with their head
+#define SENDFILE_MIN 16384
+// bodies smaller than this aren't worth compressing in the cache
+#define ZIP_MIN_SIZE 256
+// room for a /metrics page
+#define METRICS_SIZE 65536
+// seconds an admin connection may take to send its request or take the page
+#define ADMIN_TIMEOUT 5
+// how long a stale response may stand in for an unreachable or failing
+// server when the server didn't say (stale-if-error)
+#define DEFAULT_STALE_IF_ERROR 3600
+// default deadlines in seconds for a client to send its request head, for
+// an origin or peer to start answering and for a whole response to be
+// passed on, so slow or stalled peers can't hold a thread forever
+#define HEADER_TIMEOUT 10
+#define UPSTREAM_TIMEOUT 30
+#define TRANSFER_TIMEOUT 300
+// room for a request's method
+#define MAX_METHOD 16
 
 #ifndef DEBUG
 #define debug_printf(...) {}
@@ -44,27 +98,123 @@ static const char *proxy_hdr = "Proxy-Connection: close\r\n";
  *  ========================================================================
  */
 
-// function called immediately after thread creation
-void *proxy_thread(void *vargp);
+// serves a client connection on one of the admission threads, closing it
+// once done
+void serve_client(int fd);
 
-// takes a client connection file descriptor and handles their request
-void service_request(int connfd);
+// takes a client connection file descriptor and handles their request,
+// timing its stages with timer and filling in entry for the access log
+// returns 1 if the connection is kept open for another request, which
+// only peers in a fleet ask for
+int service_request(int connfd, rio_t *client, stage_timer *timer,
+                    log_record *entry);
 
-// reads the first line sent by the client and sets the hostname, path, and
-// port variables, returns 1 if not a GET request and 0 otherwise
-int parse_input(char *buffer, char *hostname, char *path, int *port);
+// reads the first line sent by the client and sets the method, hostname,
+// path, and port variables, returns 1 if it can't be handled and 0 otherwise
+// a request for a bare path (origin-form) leaves hostname empty, for the
+// Host header to fill in
+int parse_input(char *buffer, char *method, char *hostname, char *path,
+                int *port);
 
 // reads from the client and forms a header to send to the requested server
-void get_request_header(int cfd, rio_t *client, char *header);
-
-// makes a GET request on behalf of the client to the requested server
-int GET_request(char *hostname, char *path, int port, char *unparsed,
-                int *serverfd, rio_t *server, int connfd);
-
-// feeds the response from the server back to the client
-// will also attempt to cache the server's response if possible
-void respond_to_client(rio_t *server, int serverfd,
-                       int clientfd, char *cache_key);
+// the client's Range and If-Range lines are held back in ranges, since the
+// proxy fetches whole objects and cuts ranges out of them itself, and its
+// Host is left in host
+// returns 1 if the request was forwarded by a peer and 0 otherwise
+int get_request_header(int cfd, rio_t *client, char *header, char *ranges,
+                       char *host);
+
+// asks the peer owning a missed object for it and relays its response,
+// returns 0 if it was answered or -1 if the peer failed before anything
+// reached the client, which leaves the request to the origin
+int forward_to_peer(int peer, int clientfd, char *hostname, char *path,
+                    int port, char *header, char *ranges);
+
+// makes a request on behalf of the client to the requested server, up to
+// the end of its head, any body is left to the caller
+// site is the Host the request is for, in a reverse proxy the site's name
+// rather than the backend's, so backends can tell the sites they serve
+// apart
+// if validators is not NULL the request is made conditional on them
+int upstream_request(char *method, char *hostname, char *site, char *path,
+                     int port, char *unparsed, int *serverfd, rio_t *server,
+                     int connfd, meta *validators);
+
+// passes a request the cache has no part in (anything but a GET, or a HEAD
+// for an object not in the cache) on to the server and its response back
+// to the client, streaming the client's body to the server as it arrives
+// a change made through the proxy (a successful POST, PUT, DELETE...)
+// drops the cached copy of its URL
+// returns ORIGIN_OK once the server has answered, the origin_enter status
+// that turned the request away, or -1 if the server couldn't be reached
+// or failed before answering
+int pass_request(int clientfd, rio_t *client, char *method, char *hostname,
+                 char *path, int port, int route, char *header,
+                 url_key cache_key, stage_timer *timer);
+
+// reads the status line and headers of the server's response into head,
+// returns the length of the head or -1 on an error or an oversized head
+int read_response_head(rio_t *server, int serverfd, int clientfd,
+                       char *head);
+
+// feeds the response from the server back to the client, starting with
+// the already read head, will also attempt to cache the server's response
+// if possible
+// for a range request the whole response is read in and the range served
+// from it, returns 1 (with nothing sent) if it turns out too big for that,
+// or -1 (with a 502 or 504 sent) if it never came whole
+int respond_to_client(rio_t *server, int serverfd, int clientfd,
+                      url_key cache_key, char *header, char *ranges,
+                      char *head, int head_len);
+
+// writes a stored response to the client, or just the parts of it asked
+// for by the Range and If-Range lines in ranges, with a head generated
+// from the packed one, which a hit gets its Age and X-Cache added to, and
+// the body written after it as it is stored
+// compressed bodies are sent as they are to clients that accept gzip (per
+// their header) and decompressed for everyone else
+void serve_object(int clientfd, char *head, int head_len, char *body,
+                  int body_len, meta *m, char *header, char *ranges, int hit);
+
+// answers a CONNECT by connecting to hostname:port and relaying bytes both
+// ways between the server and the client until they are done, the tunnel
+// is closed after sitting idle, the request's deadlines don't apply to it
+void open_tunnel(int clientfd, rio_t *client, char *hostname, int port);
+
+// writes just the head serve_object would send for the whole object, to
+// answer a HEAD request
+void serve_head(int clientfd, char *head, int head_len, int body_len,
+                meta *m, char *header);
+
+// compresses the body of a response about to be cached if it is text that
+// will shrink, returns the new size of the response
+int compress_body(char *data, int size, int head_len, meta *m);
+
+// fills in the freshness and validator information of a response head,
+// returns 1 if the response may be cached and 0 otherwise
+int get_cache_meta(char *head, int head_len, meta *m);
+
+// finds the variant of the object stored under cache_key that matches the
+// request's headers, the caller must hold a cache lock
+object* find_cached(url_key cache_key, char *header);
+
+// updates a cached object's metadata from a 304 response to revalidation
+void refresh_cached(url_key cache_key, char *header,
+                    char *head, int head_len);
+
+// writes a cached object to the client, returns 0 if it has been evicted
+int serve_cached(int clientfd, url_key cache_key, char *header,
+                 char *ranges);
+
+// revalidates a stale object in a background thread while the stale copy
+// keeps being served (stale-while-revalidate)
+void start_refresh(char *hostname, char *path, int port, char *header,
+                   url_key cache_key, meta *validators);
+void *refresh_thread(void *vargp);
+
+// fetches a resource a cached page links to into the cache, unless it is
+// there already, for pprefetch's threads
+void prefetch_link(char *hostname, int port, char *path, char *header);
 
 // a wrapper for rio_readlineb that will safely close a thread upon an error
 int p_Rio_readlineb(int sfd, int cfd, rio_t *conn, char *buffer, size_t size);
@@ -72,15 +222,72 @@ int p_Rio_readlineb(int sfd, int cfd, rio_t *conn, char *buffer, size_t size);
 // a wrapper for rio_writen that will safely close a thread upon an error
 void p_Rio_writen(int sfd, int cfd, const char *buf, size_t len);
 
-// reader lock for the cache to allow multiple readers safely access the cache
-// readers have priority over writers and block them
-void cache_r_lock();
-void cache_r_unlock();
+// rio_writen for responses to clients, counting the bytes sent
+ssize_t client_writen(int fd, void *buf, size_t len);
+
+// the same for count buffers written one after another, in as few system
+// calls as they take, iov is used up in the process
+ssize_t client_writev(int fd, struct iovec *iov, int count);
+
+// the same for a head followed by len bytes of the file filefd from
+// offset, which go out straight from the page cache
+ssize_t client_sendfile(int fd, char *head, int head_len, int filefd,
+                        off_t offset, size_t len);
+
+// counts bytes sent to a client in the metrics and the access log
+void client_sent(long bytes);
+
+// forks count worker processes that return from here with their number to
+// serve clients, while the parent stays behind to replace any that die
+int start_workers(int count);
+
+// answers requests for /metrics on the admin port
+void *admin_thread(void *vargp);
+
+// stops the workers, prints how long requests spent in each stage and
+// exits, on SIGINT or SIGTERM
+void shutdown_proxy(int sig);
+
+
+// what a connection is waiting on
+enum watch_kind
+{
+    WATCH_HEADER,                       // the client's request head
+    WATCH_UPSTREAM,                     // the head of a response
+    WATCH_TRANSFER                      // the rest of the response
+};
+
+// a connection's deadline, when it passes the connection's sockets are
+// shut down so that whatever its thread is blocked on fails
+typedef struct watch
+{
+    deadline d;
+    int clientfd;
+    int serverfd;                       // -1 when not talking to a server
+    int kind;
+    int fired;                          // the wait on hand ran out of time
+    int cut;                            // the client was shut down
+    uint64_t transfer_end;              // the request's overall deadline
+} watch;
+
+// a URL as the client named it
+typedef struct target
+{
+    char *hostname;
+    int port;
+    char *path;
+} target;
 
-// writer lock for the cache to allow a single writer to safely alter the cache
-// all other readers and writers are blocked
-void inline cache_w_lock();
-void inline cache_w_unlock();
+// everything a background refresh needs to repeat the client's request
+typedef struct refresh_job
+{
+    char hostname[MAXLINE];
+    char path[MAXLINE];
+    char header[MAX_HEADER_SIZE];
+    url_key cache_key;
+    int port;
+    meta validators;
+} refresh_job;
 
 
 /*
@@ -90,10 +297,36 @@ void inline cache_w_unlock();
  */
 
 
-int readcnt;
-sem_t mutex;
-sem_t w;
-cache* p_cache;
+cache* p_cache;     // shared by every worker process
+bloom* door = NULL; // lets misses into the cache, NULL to cache them all
+int prefetching = 0;// fetch what cached pages link to
+int worker;         // this process's worker number
+int admin_fd = -1;  // listening for metrics scrapes, -1 if not asked for
+pid_t worker_pids[MAX_WORKERS];
+int worker_count = 0;
+int zip_level;      // compress cached text bodies at this level, 0 for off
+int access_log = 0; // write every request to LOG_FILE
+int timeouts[] = {HEADER_TIMEOUT, UPSTREAM_TIMEOUT, TRANSFER_TIMEOUT};
+int tunnel_idle = TUNNEL_IDLE;
+int tunnel_ports[TUNNEL_MAX_PORTS] = {TUNNEL_PORT};  // CONNECT may go to
+int tunnel_port_count = 1;
+int reverse = 0;    // route requests to the backends of pbackend
+char via[MAXLINE];  // this proxy's name in Via headers, to spot loops
+
+// the access log entry of the request this thread is answering
+static __thread log_record *log_entry = NULL;
+// the deadline of the connection this thread is serving
+static __thread watch *conn_watch = NULL;
+// whether the client this thread is answering takes chunked responses, as
+// HTTP/1.1 clients do, except peers, which need lengths to keep their
+// connection open
+static __thread int client_chunks = 0;
+// the URL of the miss this thread is fetching for a client, so that a page
+// can have its links prefetched, NULL for background fetches
+static __thread target *miss_target = NULL;
+// whether this thread is fetching a link for prefetching, so that the
+// object is marked as prefetched if it goes into the cache
+static __thread int prefetch_fetch = 0;
 
 
 /*
@@ -111,38 +344,177 @@ cache* p_cache;
 
 int main(int argc, char **argv)
 {    
-    int listenfd, connfd, *clientfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    int listenfd, connfd, port, opt;
+    char *next;
+    int max_conns = ADMIT_THREADS;
+    int per_origin = ORIGIN_CONCURRENCY;
+    int admin_port = 0;
+    int sort_query = 0;
+    int file_cache = 0;
+    long window = 0;
+    int budget = 0;
+    int workers = 0;
+    char *strip = NULL;
+    char *members = NULL;
+    char *routes = NULL;
+    char self[MAXLINE];
 
     // ignore broken pipe signals, we don't want to terminate the process
     // due to SIGPIPE signal
     Signal(SIGPIPE, SIG_IGN);
 
-    if (argc != 2){
-        fprintf(stderr, "usage: %s <port>\n", argv[0]); exit(0);
+    // -q sorts query parameters and -s drops the listed ones when building
+    // cache keys, so equivalent URLs share a cache entry
+    // -z keeps text objects gzip compressed in the cache
+    // -f keeps the cache in a memory backed file, hits on large objects
+    // are then sent from it with sendfile
+    // -d only caches a response on its URL's second miss within the last
+    // window misses (BLOOM_WINDOW with 0)
+    // -e prefetches what cached HTML pages link to on their own origin, up
+    // to budget links per host a minute (PREFETCH_BUDGET with 0)
+    // -w runs that many worker processes sharing the cache
+    // -p lists every proxy (host:port) in a fleet splitting the cache
+    // between them, -n names this one in the list (localhost:port default)
+    // -a serves metrics on a separate admin port
+    // -l writes an access log
+    // -m serves at most that many connections at once, the rest queue
+    // -t sets the header, upstream and transfer timeouts in seconds, and
+    // optionally how long a tunnel may sit idle
+    // -c allows that many requests in flight to any one origin
+    // -o lists the ports CONNECT may open tunnels to (TUNNEL_PORT default)
+    // -r runs as a reverse proxy in front of the backends the file routes
+    // requests to
+    zip_level = 0;
+    self[0] = '\0';
+    while ((opt = getopt(argc, argv, "a:c:d:e:flm:n:o:p:qr:s:t:w:z")) != -1){
+        switch (opt){
+        case 'a': admin_port = atoi(optarg); break;
+        case 'c': per_origin = atoi(optarg); break;
+        case 'd':
+            window = atol(optarg);
+            if (window <= 0) window = BLOOM_WINDOW;
+            break;
+        case 'e':
+            budget = atoi(optarg);
+            if (budget <= 0) budget = PREFETCH_BUDGET;
+            break;
+        case 'f': file_cache = 1; break;
+        case 'l': access_log = 1; break;
+        case 'm': max_conns = atoi(optarg); break;
+        case 'n': snprintf(self, MAXLINE, "%s", optarg); break;
+        case 'o':
+            for (tunnel_port_count = 0; tunnel_port_count < TUNNEL_MAX_PORTS;
+                 tunnel_port_count++){
+                tunnel_ports[tunnel_port_count] = strtol(optarg, &next, 10);
+                if (next == optarg ||
+                    tunnel_ports[tunnel_port_count] < 1 ||
+                    tunnel_ports[tunnel_port_count] > 65535){
+                    argc = 0;
+                    break;
+                }
+                if (*next != ','){
+                    tunnel_port_count++;
+                    if (*next != '\0') argc = 0;
+                    break;
+                }
+                optarg = next + 1;
+            }
+            if (tunnel_port_count == TUNNEL_MAX_PORTS && *next != '\0'){
+                argc = 0;
+            }
+            break;
+        case 'p': members = optarg; break;
+        case 'q': sort_query = 1; break;
+        case 'r': routes = optarg; break;
+        case 's': strip = optarg; break;
+        case 't':
+            if (sscanf(optarg, "%d,%d,%d,%d", &timeouts[WATCH_HEADER],
+                       &timeouts[WATCH_UPSTREAM], &timeouts[WATCH_TRANSFER],
+                       &tunnel_idle) < 3){
+                argc = 0;
+            }
+            break;
+        case 'w': workers = atoi(optarg); break;
+        case 'z': zip_level = ZIP_LEVEL; break;
+        default: argc = 0; break;
+        }
+    }
+    if (argc != optind+1 || workers < 0 || workers > MAX_WORKERS ||
+        max_conns < 1 || per_origin < 1 || timeouts[WATCH_HEADER] < 1 ||
+        timeouts[WATCH_UPSTREAM] < 1 || timeouts[WATCH_TRANSFER] < 1 ||
+        tunnel_idle < 1){
+        fprintf(stderr, "usage: %s [-flqz] [-a admin_port] [-c per_origin] "
+                "[-d window] [-e budget] [-m max_conns] [-o port,...] "
+                "[-r routes] "
+                "[-s param,...] "
+                "[-t header,upstream,transfer[,tunnel]] [-w workers] "
+                "[-p host:port,... [-n host:port]] <port>\n", argv[0]);
+        exit(0);
     }
 
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
+    key_init(sort_query, strip);
+    if (gethostname(via, MAXLINE / 2) != 0) strcpy(via, "localhost");
+    via[MAXLINE / 2] = '\0';
+    sprintf(via + strlen(via), ":%d", port);
+    if (self[0] == '\0') sprintf(self, "localhost:%d", port);
+    if (members != NULL && peer_init(members, self) < 0){
+        fprintf(stderr, "%s: -p must list this proxy (%s) as host:port\n",
+                argv[0], self);
+        exit(0);
+    }
+    if (routes != NULL){
+        if (backend_init(routes) < 0) exit(1);
+        reverse = 1;
+    }
     listenfd = Open_listenfd(port);
+    if (admin_port > 0) admin_fd = Open_listenfd(admin_port);
     
-    // initialize semaphores to 1
-    Sem_init(&mutex, 0, 1);
-    Sem_init(&w, 0, 1);
-    readcnt = 0;
-
-    p_cache = cache_new();
+    // the cache and the counters are mapped shared before forking so every
+    // worker sees them
+    p_cache = file_cache ? cache_new_file(MAX_SIZE) : cache_new(MAX_SIZE);
+    if (p_cache == NULL){
+        unix_error("cache_new error");
+    }
+    if (stats_init() < 0) unix_error("stats_init error");
+    if (window > 0 && (door = bloom_new(window)) == NULL){
+        unix_error("bloom_new error");
+    }
+    if (budget > 0){
+        prefetch_init(budget, prefetch_link);
+        prefetching = 1;
+    }
+    Signal(SIGINT, shutdown_proxy);
+    Signal(SIGTERM, shutdown_proxy);
+    worker = (workers > 0) ? start_workers(workers) : 0;
+    cache_attach(worker);
+
+    // each worker has its own writer thread, appending to the same file,
+    // and a ring for each connection it may serve at once, as many as fit
+    // in the descriptor limit
+    max_conns = admit_init(max_conns, serve_client);
+    if (access_log && log_init(LOG_FILE, max_conns) < 0){
+        unix_error("log_init error");
+    }
+    if (deadline_init() < 0) unix_error("deadline_init error");
+    origin_init(per_origin);
+    if (reverse) backend_start_checks();
 
-    // main thread enters infinite loop to process requests
-    while (1){
+    // any worker can answer a scrape, they all see the same counters
+    if (admin_fd >= 0){
         pthread_t tid;
-        clientfd = Malloc(sizeof(int));    // avoid race condition
-
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        *clientfd = connfd;
+        Pthread_create(&tid, NULL, admin_thread, NULL);
+    }
 
-        // spawn a thread to handle each request
-        Pthread_create(&tid, NULL, proxy_thread, (void *)clientfd);
+    // main thread enters infinite loop to process requests, handing each
+    // connection to a thread, or turning it away when overloaded, since
+    // with a thread per connection an overload used to end in a failed
+    // Pthread_create taking the whole proxy down, and running out of
+    // descriptors only slows accepting down
+    while (1){
+        connfd = admit_accept(listenfd);
+        PROBE1(request__accept, connfd);
+        admit(connfd);
     }
 
     // control should never reach here
@@ -151,99 +523,562 @@ int main(int argc, char **argv)
 }
 
 
-void *proxy_thread(void *vargp){
-    Pthread_detach(Pthread_self());
-    // detached thread gets terminated by the system once it's done
+// counts a connection as closed however its thread ends, including through
+// the p_Rio wrappers
+static void connection_closed(void *vargp){
+    stats_inc(STAT_CONNECTIONS_CLOSED);
+}
+
 
-    int fd = *(int *)vargp;
+// a connection's deadline passed, runs on the watchdog thread
+// a server that is slow to answer is only cut off itself, so the client
+// still hears about it and may get a stale copy instead
+static void watch_fired(deadline *d){
+    static const enum stat_id counters[] = {
+        STAT_TIMEOUTS_HEADER, STAT_TIMEOUTS_UPSTREAM, STAT_TIMEOUTS_TRANSFER
+    };
+    watch *w = (watch *)d;
 
-    // done with fd, free the memory allocated in main
-    Free(vargp);
+    if(w->kind != WATCH_UPSTREAM && w->clientfd >= 0){
+        shutdown(w->clientfd, SHUT_RDWR);
+        __atomic_store_n(&w->cut, 1, __ATOMIC_RELAXED);
+    }
+    if(w->serverfd >= 0) shutdown(w->serverfd, SHUT_RDWR);
+    __atomic_store_n(&w->fired, 1, __ATOMIC_RELAXED);
+    stats_inc(counters[w->kind]);
+}
 
-    service_request(fd); 
 
+// sets the deadline of this thread's connection for what it waits on next,
+// serverfd is shut down along with the client, so it must be set back to
+// -1 before serverfd is closed
+// the first transfer deadline of a request holds for the rest of it,
+// and no wait on a server may run past it
+// a new request or a new server to wait on starts with a clean slate, so
+// that a peer that timed out doesn't count against the origin tried next,
+// ending a transfer keeps whether it timed out for the caller to check
+static void watch_set(int kind, int serverfd){
+    watch *w = conn_watch;
+    uint64_t now = stats_clock();
+    uint64_t expires;
+
+    if(w == NULL) return;
+    deadline_cancel(&w->d);
+    if(kind != WATCH_TRANSFER) w->fired = 0;
+    if(kind == WATCH_HEADER) w->transfer_end = 0;
+    if(kind == WATCH_TRANSFER && w->transfer_end == 0){
+        w->transfer_end = now + timeouts[WATCH_TRANSFER] * 1000000ULL;
+    }
+
+    expires = (kind == WATCH_TRANSFER) ? w->transfer_end :
+              now + timeouts[kind] * 1000000ULL;
+    if(kind == WATCH_UPSTREAM && w->transfer_end != 0 &&
+       w->transfer_end < expires){
+        expires = w->transfer_end;
+        kind = WATCH_TRANSFER;
+    }
+    w->kind = kind;
+    w->serverfd = serverfd;
+    deadline_arm(&w->d, expires);
+}
+
+
+// whether this thread's connection ran out of time, whatever was read
+// since is cut short
+static int timed_out(){
+    return conn_watch != NULL &&
+           __atomic_load_n(&conn_watch->fired, __ATOMIC_RELAXED);
+}
+
+
+// closes a connection to a server, out of reach of the deadline first
+static void close_server(int fd){
+    watch_set(WATCH_TRANSFER, -1);
     Close(fd);
-    return NULL;
 }
 
 
-void service_request(int clientfd){
+// picks the server a request goes to, its origin or, if it was routed,
+// one of the route's backends (named in backend, MAXLINE long), and asks
+// that origin to take it, returning origin_enter's answer
+// a route without a healthy backend is treated like a failing origin
+static int enter_upstream(int route, char *hostname, int port,
+                          char *backend, char **host, int *fetch_port,
+                          int *origin){
+    *host = hostname;
+    *fetch_port = port;
+    if(route < 0) return origin_enter(hostname, port, origin);
+
+    *host = backend;
+    if(backend_pick(route, backend, MAXLINE, fetch_port) < 0){
+        return ORIGIN_BROKEN;
+    }
+    return origin_enter(backend, *fetch_port, origin);
+}
+
+
+void serve_client(int fd){
+    rio_t client;
+    stage_timer timer;
+    log_record entry;
+    watch timeout;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int keep;
+
+    // peers keep their connection open for further requests
+    stats_inc(STAT_CONNECTIONS_OPENED);
+    pthread_cleanup_push(connection_closed, NULL);
+    Rio_readinitb(&client, fd);
+    timer.start = 0;
+    memset(&entry, 0, sizeof(entry));
+    if(access_log){
+        if(getpeername(fd, (SA *)&addr, &addr_len) == 0){
+            entry.client = addr.sin_addr.s_addr;
+        }
+        log_entry = &entry;
+    }
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.d.fire = watch_fired;
+    timeout.clientfd = fd;
+    timeout.serverfd = -1;
+    conn_watch = &timeout;
+    do{
+        entry.time = 0;
+        entry.duration = 0;
+        keep = service_request(fd, &client, &timer, &entry);
+        PROBE1(request__done, keep);
+        if(access_log && entry.time != 0){
+            if(entry.duration == 0){
+                entry.duration = stats_clock() - timer.start;
+            }
+            log_request(&entry);
+        }
+        timer_done(&timer);
+    }while(keep && !timeout.cut);
+    pthread_cleanup_pop(1);
+
+    log_entry = NULL;
+    deadline_cancel(&timeout.d);
+    conn_watch = NULL;
+    Close(fd);
+    return;
+}
+
+
+int service_request(int clientfd, rio_t *client, stage_timer *timer,
+                    log_record *entry){
     char buffer[MAXLINE];
-    char cache_key[MAXLINE];
+    url_key cache_key;
+    char method[MAX_METHOD];
     char hostname[MAXLINE];
     char path[MAXLINE];
+    char host[MAXLINE];
+    char backend_host[MAXLINE];
+    char *fetch_host;
+    char head[MAX_HEADER_SIZE];
+    char ranges[MAX_HEADER_SIZE];
     char *header;
+    char *range_hdr;
+    int head_len;
     int port;
     int serverfd;
-    rio_t client;
     rio_t server;
     char *error = "ERROR 404 Not Found";
+    char *unavailable = "HTTP/1.0 503 Service Unavailable\r\n"
+                        "Retry-After: 1\r\nContent-Length: 0\r\n\r\n";
+    char *no_route = "HTTP/1.0 404 Not Found\r\n"
+                     "Content-Length: 0\r\n\r\n";
+    char *bad_request = "HTTP/1.0 400 Bad Request\r\n"
+                        "Content-Length: 0\r\n\r\n";
+    char *bad_gateway = "HTTP/1.0 502 Bad Gateway\r\n"
+                        "Content-Length: 0\r\n\r\n";
+    char *loop = "HTTP/1.0 508 Loop Detected\r\n"
+                 "Content-Length: 0\r\n\r\n";
+    char *not_allowed = "HTTP/1.0 405 Method Not Allowed\r\n"
+                        "Content-Length: 0\r\n\r\n";
+    char *forbidden = "HTTP/1.0 403 Forbidden\r\n"
+                      "Content-Length: 0\r\n\r\n";
+    char *colon;
     object* cache_obj;
+    meta validators;
+    target url;
+    time_t now;
+    int status;
     int cache_hit = 0;
+    int stale = 0;
+    int refresh = 0;
+    int from_peer;
+    int keep = 0;
+    int too_big;
+    int owner;
+    int admitted;
+    int origin;
+    int route = -1;
+    int fetch_port;
+    int head_only;
+    int passed;
+    int i;
 
     // initialize the request entries
     buffer[0] = '\0';
     path[0] = '\0';
     hostname[0] = '\0';
+    host[0] = '\0';
     port = 80;
 
-    // initialize RIO reading
-    Rio_readinitb(&client, clientfd);
+    // store the first line in client input to buffer, a client that is
+    // too slow about sending its request is cut off
+    watch_set(WATCH_HEADER, -1);
+    p_Rio_readlineb(0, clientfd, client, buffer, MAXLINE);
 
-    // store the first line in client input to buffer
-    p_Rio_readlineb(0, clientfd, &client, buffer, MAXLINE);
-
-    if (parse_input(buffer, hostname, path, &port) != 0){
-        return; // not a GET request
+    // a connection closed between requests just ends
+    if (parse_input(buffer, method, hostname, path, &port) != 0){
+        if(buffer[0] != '\0'){
+            client_writen(clientfd, bad_request, strlen(bad_request));
+        }
+        return 0;
+    }
+    stats_inc(STAT_REQUESTS);
+    timer_start(timer);
+    client_chunks = (strstr(buffer, " HTTP/1.1") != NULL);
+    if(access_log){
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        entry->time = tv.tv_sec * 1000000ULL + tv.tv_usec;
+        entry->bytes = 0;
+        entry->status = 0;
+        entry->result = LOG_MISS;
     }
-    // create a key for future cache lookup
-    sprintf(cache_key, "%s %s", hostname, path);
 
     header = malloc(MAX_HEADER_SIZE);
     bzero(header, MAX_HEADER_SIZE);
-    get_request_header(clientfd, &client, header);
+    ranges[0] = '\0';
+    from_peer = get_request_header(clientfd, client, header, ranges, host);
+    if(from_peer) client_chunks = 0;
+    range_hdr = (ranges[0] != '\0') ? ranges : NULL;
+
+    // a request for a bare path names its site in Host, a reverse proxy
+    // caches under the site's name whichever backend ends up answering
+    if(hostname[0] == '\0'){
+        snprintf(hostname, MAXLINE, "%s", host);
+        if((colon = strchr(hostname, ':')) != NULL){
+            *colon = '\0';
+            if(!reverse) port = atoi(colon + 1);
+        }
+    }
+    if(hostname[0] == '\0'){
+        entry->status = 400;
+        client_writen(clientfd, bad_request, strlen(bad_request));
+        free(header);
+        return 0;
+    }
+
+    // a request that names the proxy itself as its site would otherwise
+    // be sent back to it over and over
+    if(http_via_has(header, via)){
+        entry->status = 508;
+        client_writen(clientfd, loop, strlen(loop));
+        free(header);
+        return 0;
+    }
+
+    // a tunnel's bytes are none of the cache's business, and a reverse
+    // proxy only lets requests through to its backends
+    if(strcmp(method, "CONNECT") == 0){
+        for(i = 0; i < tunnel_port_count && tunnel_ports[i] != port; i++);
+        if(reverse){
+            client_writen(clientfd, not_allowed, strlen(not_allowed));
+        }
+        else if(i == tunnel_port_count){
+            entry->status = 403;
+            client_writen(clientfd, forbidden, strlen(forbidden));
+        }
+        else{
+            if(access_log){
+                snprintf(entry->url, LOG_URL, "%.64s:%d", hostname, port);
+            }
+            open_tunnel(clientfd, client, hostname, port);
+
+            // how long a tunnel stayed open would swamp the request
+            // latencies, it only goes in the access log
+            entry->duration = stats_clock() - timer->start;
+            timer->start = 0;
+        }
+        free(header);
+        return 0;
+    }
+    if(reverse){
+        if((route = backend_route(hostname, path)) < 0){
+            entry->status = 404;
+            client_writen(clientfd, no_route, strlen(no_route));
+            free(header);
+            return 0;
+        }
+    }
+    if(access_log){
+        // long URLs are cut short, host and path each keeping their start
+        snprintf(entry->url, LOG_URL, "http://%.64s:%d%.120s", hostname,
+                 port, path);
+    }
+
+    // create a key for future cache lookup
+    cache_key = key_request(hostname, port, path);
+    url.hostname = hostname;
+    url.port = port;
+    url.path = path;
+    timer_stage(timer, STAGE_REQUEST);
+    watch_set(WATCH_TRANSFER, -1);
+    PROBE3(request__parsed, hostname, port, path);
+
+    // only GETs are cached, HEADs are answered from what they cached
+    head_only = (strcmp(method, "HEAD") == 0);
+    passed = !head_only && strcmp(method, "GET") != 0;
     
-    // search the cache
-    cache_r_lock();
-    cache_obj = cache_lookup(p_cache, cache_key);
-    if(cache_obj != NULL) cache_hit = 1;
-    cache_r_unlock();
+    // search the cache, a stale object leaves its validators behind so
+    // the server can be asked whether it is still good
+    cache_r_lock(p_cache);
+    cache_obj = passed ? NULL : find_cached(cache_key, header);
+    if(cache_obj != NULL){
+        now = time(NULL);
+        validators = cache_obj->meta;
+        stale = (now >= cache_obj->meta.expires);
+
+        // within the stale-while-revalidate window the stale copy is
+        // served right away and refreshed behind the client's back
+        if(!stale || now < cache_obj->meta.stale_while){
+            cache_hit = 1;
+            timer->hit = 1;
+            stats_inc(STAT_HITS);
+            if(stale) stats_inc(STAT_STALE_SERVED);
+            entry->result = stale ? LOG_STALE : LOG_HIT;
+            PROBE2(cache__hit, cache_key.hash, stale);
+            if(cache_obj->meta.prefetched &&
+               __atomic_exchange_n(&cache_obj->meta.prefetched, 0,
+                                   __ATOMIC_RELAXED)){
+                stats_inc(STAT_PREFETCH_HITS);
+            }
+            if(head_only){
+                serve_head(clientfd, object_data(cache_obj),
+                           cache_obj->head_size, object_body_size(cache_obj),
+                           &cache_obj->meta, header);
+            }
+            else{
+                serve_object(clientfd, object_data(cache_obj),
+                             cache_obj->head_size, object_body(cache_obj),
+                             object_body_size(cache_obj), &cache_obj->meta,
+                             header, range_hdr, 1);
+            }
+            timer_stage(timer, STAGE_SERVE);
+
+            // a peer can only send another request once it can tell where
+            // this response ends
+            keep = from_peer && (range_hdr != NULL ||
+                                 http_packed_field(object_data(cache_obj),
+                                                   cache_obj->head_size,
+                                                   "Content-Length", buffer,
+                                                   MAXLINE));
+        }
+    }
+    cache_r_unlock(p_cache);
+
+    // anything the cache can't answer, and a HEAD can't fill it either, is
+    // left to the server
+    if(!cache_hit && (passed || head_only)){
+        if(head_only){
+            stats_inc(STAT_MISSES);
+            PROBE1(cache__miss, cache_key.hash);
+        }
+        status = pass_request(clientfd, client, method, hostname, path,
+                              port, route, header, cache_key, timer);
+        if(status != ORIGIN_OK){
+            entry->result = LOG_ERROR;
+            entry->status = (status < 0) ? 502 : 503;
+            error = (status < 0) ? bad_gateway : unavailable;
+            client_writen(clientfd, error, strlen(error));
+        }
+        free(header);
+        return 0;
+    }
 
     // cache hit
     if(cache_hit){
+        // look the object up again, it may have been evicted once the
+        // read lock was released
+        cache_w_lock(p_cache);
+        cache_obj = find_cached(cache_key, header);
+        if(cache_obj != NULL){
+            cache_update(p_cache, cache_obj);
+
+            // only one refresh per object, whoever sets the flag starts it
+            if(stale && !cache_obj->refreshing){
+                cache_obj->refreshing = worker + 1;
+                refresh = 1;
+            }
+        }
+        cache_w_unlock(p_cache);
 
-        cache_r_lock();
-        rio_writen(clientfd, (void*)cache_obj->data, cache_obj->size);
-        cache_r_unlock();
-
-        cache_w_lock();
-        cache_update(p_cache, cache_obj);
-        cache_w_unlock();
+        if(refresh){
+            start_refresh(hostname, path, port, header, cache_key,
+                          &validators);
+        }
     }
-    // send server request if not in cache
+    // send server request if not in cache or the cached copy is stale
     else{
-        if(GET_request(hostname, path, port, header, 
-                       &serverfd, &server, clientfd) != 0){
-            //failed connection to server
-            rio_writen(clientfd, error, strlen(error));
-            Free(header);
-            return;
-        }  
-        respond_to_client(&server, serverfd, clientfd, cache_key);
-        Close(serverfd);
+        stats_inc(STAT_MISSES);
+        PROBE1(cache__miss, cache_key.hash);
+
+        // a miss on a key another proxy in the fleet owns goes to it, a
+        // request that came from a peer is never passed on again
+        owner = from_peer ? -1 : peer_owner(cache_key.hash);
+        if(owner >= 0 && forward_to_peer(owner, clientfd, hostname, path,
+                                         port, header, ranges) == 0){
+            stats_inc(STAT_PEER_FORWARDS);
+            entry->result = LOG_PEER;
+            free(header);
+            return 0;
+        }
+
+        while(1){
+            head_len = -1;
+            serverfd = -1;
+
+            // an origin that is failing or has too much in flight is
+            // treated like one that can't be reached, without waiting on
+            // it
+            admitted = enter_upstream(route, hostname, port, backend_host,
+                                      &fetch_host, &fetch_port, &origin);
+            if(admitted == ORIGIN_OK &&
+               upstream_request("GET", fetch_host, hostname, path,
+                                fetch_port, header, &serverfd, &server,
+                                clientfd, stale ? &validators : NULL) == 0){
+                timer_stage(timer, STAGE_CONNECT);
+                head_len = read_response_head(&server, serverfd, clientfd,
+                                              head);
+                timer_stage(timer, STAGE_FIRST_BYTE);
+                watch_set(WATCH_TRANSFER, serverfd);
+                PROBE1(upstream__first__byte, head_len);
+            }
+            if(head_len < 0){
+                //failed connection to server
+                if(serverfd >= 0) close_server(serverfd);
+                if(admitted == ORIGIN_OK){
+                    origin_leave(origin, 0);
+                    stats_inc(STAT_UPSTREAM_ERRORS);
+                }
+
+                // a stale copy is better than nothing (stale-if-error)
+                if(stale && time(NULL) < validators.stale_error &&
+                   serve_cached(clientfd, cache_key, header, range_hdr)){
+                    stats_inc(STAT_STALE_SERVED);
+                    entry->result = LOG_STALE;
+                    free(header);
+                    return 0;
+                }
+                entry->result = LOG_ERROR;
+                if(admitted != ORIGIN_OK) error = unavailable;
+                entry->status = (admitted != ORIGIN_OK) ? 503 : 404;
+                client_writen(clientfd, error, strlen(error));
+                Free(header);
+                return 0;
+            }
+            status = http_status(head);
+
+            // the stale copy is either still good or the server is failing
+            // and it may stand in for the server's error
+            if(stale && (status == 304 ||
+                         (status >= 500 &&
+                          time(NULL) < validators.stale_error))){
+                close_server(serverfd);
+                origin_leave(origin, 1);
+                if(status == 304){
+                    stats_inc(STAT_REVALIDATED);
+                    entry->result = LOG_REVALIDATED;
+                    refresh_cached(cache_key, header, head, head_len);
+                }
+                else{
+                    stats_inc(STAT_STALE_SERVED);
+                    entry->result = LOG_STALE;
+                }
+                if(serve_cached(clientfd, cache_key, header, range_hdr)){
+                    timer_stage(timer, STAGE_SERVE);
+                    free(header);
+                    return 0;
+                }
+                // evicted in the meantime, fetch the whole object instead
+                stale = 0;
+                continue;
+            }
+            entry->result = LOG_MISS;
+            if(range_hdr == NULL) entry->status = status;
+            miss_target = &url;
+            too_big = respond_to_client(&server, serverfd, clientfd,
+                                        cache_key, header, range_hdr, head,
+                                        head_len);
+            miss_target = NULL;
+            timer_stage(timer, STAGE_RELAY);
+            PROBE1(relay__done, cache_key.hash);
+            // a range that never came is answered with an error, after
+            // which the connection isn't worth keeping
+            if(too_big <= 0){
+                keep = from_peer && too_big == 0 &&
+                    ((range_hdr != NULL && status == 200) ||
+                     http_header(head, head_len, "Content-Length", buffer,
+                                 MAXLINE));
+                break;
+            }
+
+            // the object is too big to cache and cut the range out of, so
+            // pass the client's Range on and let the server do it
+            close_server(serverfd);
+            origin_leave(origin, 1);
+            strcat(header, ranges);
+            range_hdr = NULL;
+            stale = 0;
+        }
+        close_server(serverfd);
+        origin_leave(origin, !timed_out());
     }
     free(header);
-    return;
+    return keep;
 }
 
 
-int parse_input(char *buffer, char *hostname, char *path, int *port)
+int parse_input(char *buffer, char *method, char *hostname, char *path,
+                int *port)
 {
-    // not a request we can handle
-    if (strncmp(buffer, "GET http://", strlen("GET http://")) != 0) return 1;
+    int offset;
+    int i;
+
+    if (sscanf(buffer, "%15s", method) != 1) return 1;
+    offset = strlen(method);
+    while (buffer[offset] == ' ') offset++;
+
+    // a tunnel is asked for by host and port alone
+    if (strcmp(method, "CONNECT") == 0){
+        i = strcspn(buffer + offset, ": \r\n");
+        if (i == 0 || i >= MAXLINE || buffer[offset + i] != ':' ||
+            sscanf(buffer + offset + i + 1, "%d", port) != 1){
+            return 1;
+        }
+        memcpy(hostname, buffer + offset, i);
+        hostname[i] = '\0';
+        return 0;
+    }
 
-    int offset = strlen("GET http://");
-    int i = offset;
+    // the Host header names the site
+    if (buffer[offset] == '/'){
+        sscanf(buffer + offset, "%s", path);
+        return 0;
+    }
+
+    // not a request we can handle
+    if (strncmp(buffer + offset, "http://", strlen("http://")) != 0){
+        return 1;
+    }
+    offset += strlen("http://");
+    i = offset;
 
     // add hostname to buffer
     while(buffer[i] != '\0')
@@ -260,33 +1095,154 @@ int parse_input(char *buffer, char *hostname, char *path, int *port)
     else sscanf(&buffer[i], "%s", path);
 
     hostname[i-offset] = '\0';
+    if (path[0] == '\0') strcpy(path, "/");
     return 0;
 }
 
 
-void get_request_header(int cfd, rio_t *client, char *header){
+int get_request_header(int cfd, rio_t *client, char *header, char *ranges,
+                       char *host){
     int bytes;
     int total_bytes = 0;
+    int from_peer = 0;
     char buffer[MAXLINE];
 
     while((bytes = p_Rio_readlineb(0, cfd, client, buffer, MAXLINE))){
-        if(buffer[0] == '\r'){
-            strncat(header, buffer, bytes);
-            return;
+        // upstream_request ends the header with its own blank line
+        if(buffer[0] == '\r') break;
+        // only a proxy in the fleet may ask to be answered as a peer, the
+        // field is dropped from anyone else's request
+        if(strncasecmp(buffer, "X-Proxy-Peer:",
+                       strlen("X-Proxy-Peer:")) == 0){
+            from_peer = peer_trusted(cfd);
+            continue;
         }
         // proxy overwrites these fields so skip reading them from client
+        if(strncasecmp(buffer, "Host:", strlen("Host:")) == 0){
+            sscanf(buffer + strlen("Host:"), "%s", host);
+        }
         if(strstr(buffer, "Host:") != NULL) continue;
         if(strstr(buffer, "User-Agent:") != NULL) continue;
         if(strstr(buffer, "Accept:") != NULL) continue;
         if(strstr(buffer, "Connection:") != NULL) continue;
         if(strstr(buffer, "Proxy-Connection:") != NULL) continue;
+        // cached objects are always served whole, so the proxy makes its
+        // own conditional requests rather than passing on the client's
+        if(strstr(buffer, "If-None-Match:") != NULL) continue;
+        if(strstr(buffer, "If-Modified-Since:") != NULL) continue;
 
         // make sure we don't exceed the header size
         total_bytes += bytes;
-        if(total_bytes > MAX_HEADER_SIZE) break;
+        if(total_bytes >= MAX_HEADER_SIZE) break;
+
+        // also catches If-Range
+        if(strstr(buffer, "Range:") != NULL){
+            strncat(ranges, buffer, bytes);
+            continue;
+        }
         strncat(header, buffer, bytes);
     }
-    return;
+    return from_peer;
+}
+
+
+// sends a request for an object to a peer, marked so that the peer answers
+// it itself and keeps the connection open, returns 0 on success
+static int send_peer_request(int fd, char *hostname, char *path, int port,
+                             char *header, char *ranges){
+    char line[MAXLINE];
+    int len;
+
+    len = snprintf(line, MAXLINE, "GET http://%s:%d", hostname, port);
+    if(rio_writen(fd, line, len) != len) return -1;
+    if(rio_writen(fd, path, strlen(path)) != strlen(path)) return -1;
+
+    len = snprintf(line, MAXLINE, " HTTP/1.1\r\nHost: %s\r\n"
+                   "X-Proxy-Peer: 1\r\nConnection: keep-alive\r\n",
+                   hostname);
+    if(rio_writen(fd, line, len) != len) return -1;
+    if(rio_writen(fd, header, strlen(header)) != strlen(header)) return -1;
+    if(rio_writen(fd, ranges, strlen(ranges)) != strlen(ranges)) return -1;
+    if(rio_writen(fd, "\r\n", 2) != 2) return -1;
+    return 0;
+}
+
+
+// reads a peer's response head, unlike read_response_head a broken
+// connection is reported rather than ending the thread, since the request
+// can still go to the origin
+static int read_peer_head(rio_t *peer, char *head){
+    int bytes;
+    int head_len = 0;
+
+    while(head_len < MAX_HEADER_SIZE-1 &&
+          (bytes = rio_readlineb(peer, head+head_len,
+                                 MAX_HEADER_SIZE-head_len)) > 0){
+        head_len += bytes;
+        if(head[head_len-1] != '\n') return -1;
+
+        if(bytes == 1 || (bytes == 2 && head[head_len-2] == '\r')){
+            return (http_status(head) != 0) ? head_len : -1;
+        }
+    }
+    return -1;
+}
+
+
+int forward_to_peer(int peer, int clientfd, char *hostname, char *path,
+                    int port, char *header, char *ranges){
+    char head[MAX_HEADER_SIZE];
+    char buffer[MAXLINE];
+    rio_t peer_rio;
+    long length = -1;
+    int head_len = -1;
+    int reused;
+    int bytes;
+    int fd;
+
+    // an idle connection may have been closed by the peer since it was last
+    // used, so that failure gets one more try on a new connection, and a
+    // peer that doesn't answer the connect is given up on like an origin
+    while((fd = peer_connect(peer, timeouts[WATCH_UPSTREAM] * 1000,
+                             &reused)) >= 0){
+        Rio_readinitb(&peer_rio, fd);
+        watch_set(WATCH_UPSTREAM, fd);
+        if(send_peer_request(fd, hostname, path, port, header, ranges) == 0 &&
+           (head_len = read_peer_head(&peer_rio, head)) > 0){
+            watch_set(WATCH_TRANSFER, fd);
+            break;
+        }
+        watch_set(WATCH_TRANSFER, -1);
+        close(fd);
+        if(!reused) break;
+    }
+    if(head_len < 0){
+        stats_inc(STAT_PEER_ERRORS);
+        peer_failed(peer);
+        return -1;
+    }
+
+    // without a length the peer ends the response by closing the connection
+    p_Rio_writen(clientfd, fd, head, head_len);
+    if(log_entry != NULL) log_entry->status = http_status(head);
+    client_sent(head_len);
+    if(http_header(head, head_len, "Content-Length", buffer, MAXLINE)){
+        length = atol(buffer);
+    }
+    while(length != 0 &&
+          (bytes = rio_readnb(&peer_rio, buffer,
+                              (length > 0 && length < MAXLINE) ?
+                              length : MAXLINE)) > 0){
+        p_Rio_writen(clientfd, fd, buffer, bytes);
+        client_sent(bytes);
+        if(length > 0) length -= bytes;
+    }
+
+    // a response the deadline cut short leaves the connection unusable
+    watch_set(WATCH_TRANSFER, -1);
+    if(length == 0 && !timed_out()) peer_release(peer, fd);
+    else close(fd);
+    return 0;
 }
 
 
@@ -295,6 +1251,7 @@ int p_Rio_readlineb(int sfd, int cfd, rio_t *conn, char *buffer, size_t size){
 
     if((bytes = rio_readlineb(conn, buffer, size)) < 0){
         // exit thread
+        if(conn_watch != NULL) deadline_cancel(&conn_watch->d);
         if(sfd) close(sfd);
         close(cfd);
         Pthread_exit(NULL);
@@ -306,6 +1263,7 @@ int p_Rio_readlineb(int sfd, int cfd, rio_t *conn, char *buffer, size_t size){
 void p_Rio_writen(int sfd, int cfd, const char* buf, size_t len){
     if(rio_writen(sfd, (void*)buf, len) < 0){
         // exit thread
+        if(conn_watch != NULL) deadline_cancel(&conn_watch->d);
         close(sfd);
         close(cfd);
         Pthread_exit(NULL);
@@ -313,21 +1271,113 @@ void p_Rio_writen(int sfd, int cfd, const char* buf, size_t len){
 }
 
 
-int GET_request(char *hostname, char *path, int port, char *header,
-                int *serverfd, rio_t *server, int connfd){
+ssize_t client_writen(int fd, void *buf, size_t len){
+    ssize_t n = rio_writen(fd, buf, len);
+
+    // the first thing written is the status line
+    if(n > 0 && log_entry != NULL && log_entry->status == 0){
+        log_entry->status = http_status((char *)buf);
+    }
+    if(n > 0) client_sent(n);
+    return n;
+}
+
+
+ssize_t client_writev(int fd, struct iovec *iov, int count){
+    int status = (count > 0) ? http_status(iov[0].iov_base) : 0;
+    ssize_t total = 0;
+    ssize_t n;
+
+    while(count > 0){
+        if((n = writev(fd, iov, count)) < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        total += n;
+
+        // skip what went out whole, and the part of a buffer that didn't
+        while(count > 0 && n >= (ssize_t)iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    if(total > 0 && log_entry != NULL && log_entry->status == 0){
+        log_entry->status = status;
+    }
+    if(total > 0) client_sent(total);
+    return (count == 0) ? total : -1;
+}
+
 
-    *serverfd = open_clientfd_r(hostname, port);
+ssize_t client_sendfile(int fd, char *head, int head_len, int filefd,
+                        off_t offset, size_t len){
+    ssize_t total = 0;
+    ssize_t n;
+
+    // the head is held back until the body follows, so they can share
+    // packets
+    while(total < head_len){
+        if((n = send(fd, head + total, head_len - total, MSG_MORE)) < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        total += n;
+    }
+    while(total >= head_len && len > 0){
+        if((n = sendfile(fd, filefd, &offset, len)) <= 0){
+            if(n < 0 && errno == EINTR) continue;
+            break;
+        }
+        total += n;
+        len -= n;
+    }
+
+    if(total > 0 && log_entry != NULL && log_entry->status == 0){
+        log_entry->status = http_status(head);
+    }
+    if(total > 0) client_sent(total);
+    return (total >= head_len && len == 0) ? total : -1;
+}
+
+
+void client_sent(long bytes){
+    stats_add(STAT_CLIENT_BYTES, bytes);
+    if(log_entry != NULL) log_entry->bytes += bytes;
+}
+
+
+int upstream_request(char *method, char *hostname, char *site, char *path,
+                     int port, char *header, int *serverfd, rio_t *server,
+                     int connfd, meta *validators){
+    char *version = " HTTP/1.1\r\n";
+
+    PROBE2(upstream__connect__start, hostname, port);
+    *serverfd = open_clientfd_t(hostname, port,
+                                timeouts[WATCH_UPSTREAM] * 1000);
+    stats_inc(STAT_UPSTREAM_CONNECTS);
+    PROBE1(upstream__connect__done, *serverfd);
+    if(*serverfd >= 0) watch_set(WATCH_UPSTREAM, *serverfd);
 
     // couldn't connect to server
-    if(*serverfd < 0) return 1;
+    if(*serverfd < 0){
+        stats_inc(STAT_UPSTREAM_CONNECT_ERRORS);
+        return 1;
+    }
                                     
     // send server an edited verision of the client's header                                         
     Rio_readinitb(server, *serverfd);
-    p_Rio_writen(*serverfd, connfd, "GET ", strlen("GET "));
+    p_Rio_writen(*serverfd, connfd, method, strlen(method));
+    p_Rio_writen(*serverfd, connfd, " ", strlen(" "));
     p_Rio_writen(*serverfd, connfd, path, strlen(path));
-    p_Rio_writen(*serverfd, connfd, " HTTP/1.0\r\n", strlen(" HTTP/1.0\r\n"));
+    p_Rio_writen(*serverfd, connfd, version, strlen(version));
     p_Rio_writen(*serverfd, connfd, "Host: ", strlen("Host: "));
-    p_Rio_writen(*serverfd, connfd, hostname, strlen(hostname));
+    p_Rio_writen(*serverfd, connfd, site, strlen(site));
     p_Rio_writen(*serverfd, connfd, "\r\n", strlen("\r\n"));
     p_Rio_writen(*serverfd, connfd, user_agent_hdr, strlen(user_agent_hdr));
     p_Rio_writen(*serverfd, connfd, accept_hdr, strlen(accept_hdr));
@@ -335,6 +1385,25 @@ int GET_request(char *hostname, char *path, int port, char *header,
                  strlen(accept_encoding_hdr));
     p_Rio_writen(*serverfd, connfd, connection_hdr, strlen(connection_hdr));
     p_Rio_writen(*serverfd, connfd, proxy_hdr, strlen(proxy_hdr));
+    p_Rio_writen(*serverfd, connfd, "Via: 1.0 ", strlen("Via: 1.0 "));
+    p_Rio_writen(*serverfd, connfd, via, strlen(via));
+    p_Rio_writen(*serverfd, connfd, "\r\n", strlen("\r\n"));
+
+    // revalidating a stale copy, only ask for the body if it has changed
+    if(validators != NULL && validators->etag[0] != '\0'){
+        p_Rio_writen(*serverfd, connfd, "If-None-Match: ",
+                     strlen("If-None-Match: "));
+        p_Rio_writen(*serverfd, connfd, validators->etag,
+                     strlen(validators->etag));
+        p_Rio_writen(*serverfd, connfd, "\r\n", strlen("\r\n"));
+    }
+    if(validators != NULL && validators->last_modified[0] != '\0'){
+        p_Rio_writen(*serverfd, connfd, "If-Modified-Since: ",
+                     strlen("If-Modified-Since: "));
+        p_Rio_writen(*serverfd, connfd, validators->last_modified,
+                     strlen(validators->last_modified));
+        p_Rio_writen(*serverfd, connfd, "\r\n", strlen("\r\n"));
+    }
     p_Rio_writen(*serverfd, connfd, header, strlen(header));
     p_Rio_writen(*serverfd, connfd, "\r\n", strlen("\r\n"));
 
@@ -342,64 +1411,1279 @@ int GET_request(char *hostname, char *path, int port, char *header,
 }
 
 
-void respond_to_client(rio_t *server, int serverfd,
-                       int clientfd, char *cache_key){
+int read_response_head(rio_t *server, int serverfd, int clientfd,
+                       char *head){
+    int bytes;
+    int head_len = 0;
+
+    while(head_len < MAX_HEADER_SIZE-1 &&
+          (bytes = p_Rio_readlineb(serverfd, clientfd, server, head+head_len,
+                                   MAX_HEADER_SIZE-head_len)) > 0){
+        head_len += bytes;
+        if(head[head_len-1] != '\n') return -1;   // head too large
+
+        // a blank line ends the head
+        if(bytes == 1 || (bytes == 2 && head[head_len-2] == '\r')){
+            return head_len;
+        }
+    }
+    return -1; // server closed the connection before finishing the head
+}
+
+
+// reads whatever has arrived of a response, up to size bytes, taking what
+// is left in server's buffer first, unlike rio_readnb it doesn't wait for
+// more, so it can't block past the end of a response on a connection the
+// server keeps open, returns 0 once the server closed it
+static ssize_t read_some(rio_t *server, char *buf, size_t size){
+    ssize_t n;
+
+    if(server->rio_cnt > 0){
+        n = ((size_t)server->rio_cnt < size) ? server->rio_cnt : size;
+        memcpy(buf, server->rio_bufptr, n);
+        server->rio_bufptr += n;
+        server->rio_cnt -= n;
+        return n;
+    }
+    while((n = read(server->rio_fd, buf, size)) < 0 && errno == EINTR);
+    return n;
+}
+
+
+// passes the head of a response on to the client, a chunked one as it
+// is if the client takes chunks, otherwise without its Transfer-Encoding,
+// its body then being ended by the close of the connection
+static void relay_head(int clientfd, int serverfd, char *head, int head_len,
+                       http_body *body){
+    static const char *drop[] = {"Transfer-Encoding", "Content-Length",
+                                 "Trailer", NULL};
+    char plain[MAX_HEADER_SIZE];
+    int len;
+
+    if(body->framing == HTTP_CHUNKED && !client_chunks &&
+       (len = http_rewrite_head(plain, MAX_HEADER_SIZE, head, head_len,
+                                NULL, drop, "")) > 0){
+        head = plain;
+        head_len = len;
+    }
+    p_Rio_writen(clientfd, serverfd, head, head_len);
+    client_sent(head_len);
+}
+
+
+// passes len bytes of a decoded body on to the client, as a chunk of
+// their own if chunked
+static void relay_piece(int clientfd, int serverfd, char *data, int len,
+                        int chunked){
+    char size[32];
+    int n;
+
+    if(len <= 0) return;
+    if(chunked){
+        n = sprintf(size, "%x\r\n", len);
+        p_Rio_writen(clientfd, serverfd, size, n);
+        client_sent(n);
+    }
+    p_Rio_writen(clientfd, serverfd, data, len);
+    client_sent(len);
+    if(chunked){
+        p_Rio_writen(clientfd, serverfd, "\r\n", 2);
+        client_sent(2);
+    }
+}
+
+
+// ends a chunked body sent with relay_piece, left out when the server's
+// response was cut short so the client can tell
+static void relay_end(int clientfd, int serverfd){
+    p_Rio_writen(clientfd, serverfd, "0\r\n\r\n", 5);
+    client_sent(5);
+}
+
+
+// fields of a response that aren't kept in the cache, they only concern
+// this hop, are generated for each hit or describe the framing
+static const char *unstored[] = {"Transfer-Encoding", "Content-Length",
+                                 "Trailer", "Connection", "Keep-Alive",
+                                 "Proxy-Connection", "Age", "X-Cache", NULL};
+
+
+// packs the head of a response read in whole, for the cache, with its
+// framing replaced by the Content-Length of the decoded body and without
+// the fields that only concern this hop or are generated for each hit
+// a response that came without a Date is given the time it arrived
+// returns the packed length, or -1 if the head is too big
+static int pack_head(char *packed, char *head, int head_len, int body_len){
+    char plain[MAX_HEADER_SIZE];
+    char extra[MAXLINE];
+    int n;
+    int len;
+
+    n = sprintf(extra, "Content-Length: %d\r\n", body_len);
+    if(!http_header(head, head_len, "Date", plain, MAXLINE)){
+        n += sprintf(&extra[n], "Date: ");
+        n += http_format_date(&extra[n], MAXLINE - n - 2, time(NULL));
+        sprintf(&extra[n], "\r\n");
+    }
+    len = http_rewrite_head(plain, MAX_HEADER_SIZE, head, head_len, NULL,
+                            unstored, extra);
+    if(len < 0) return -1;
+    return http_pack_head(packed, MAX_HEADER_SIZE, plain, len);
+}
+
+
+// writes out the head of a cached object updated by a 304 for it: each
+// field the 304 sends replaces the stored one of that name, the others are
+// kept, a 304 that came without a Date is given the time it arrived
+// returns the length of the merged head, or -1 if it is too big
+static int merge_head(char *merged, object *obj, char *head, int head_len){
+    const char *names[MAX_FIELDS + 1];
+    char update[MAX_HEADER_SIZE];
+    char packed[MAX_HEADER_SIZE];
+    char extra[MAXLINE];
+    char *fields;
+    char *p;
+    int packed_len;
+    int len;
+    int n = 0;
+
+    extra[0] = '\0';
+    if(!http_header(head, head_len, "Date", update, MAXLINE)){
+        n = sprintf(extra, "Date: ");
+        n += http_format_date(&extra[n], MAXLINE - n - 2, time(NULL));
+        sprintf(&extra[n], "\r\n");
+    }
+    len = http_rewrite_head(update, MAX_HEADER_SIZE, head, head_len, NULL,
+                            unstored, extra);
+    if(len < 0 ||
+       (packed_len = http_pack_head(packed, MAX_HEADER_SIZE, update,
+                                    len)) < 0){
+        return -1;
+    }
+
+    // the names of the fields the 304 sends, skipping its status line
+    n = 0;
+    for(p = packed + strlen(packed) + 1; p < packed + packed_len;
+        p += strlen(p) + 1){
+        if(n == MAX_FIELDS) return -1;
+        names[n++] = p;
+        p += strlen(p) + 1;
+    }
+    names[n] = NULL;
+
+    // the 304's field lines, without its status line and the blank line
+    fields = strstr(update, "\r\n") + 2;
+    update[len - 2] = '\0';
+    return http_unpack_head(merged, MAX_HEADER_SIZE, object_data(obj),
+                            obj->head_size, NULL, names, fields);
+}
+
+
+// copies the next length bytes the client sends to the server, returns 0
+// once done or -1 if the client stopped short
+static int relay_body(rio_t *client, int clientfd, int serverfd,
+                      long length){
+    char buffer[MAXLINE];
+    long bytes;
+
+    while(length > 0){
+        bytes = rio_readnb(client, buffer,
+                           (length < MAXLINE) ? length : MAXLINE);
+        if(bytes <= 0) return -1;
+        p_Rio_writen(serverfd, clientfd, buffer, bytes);
+        length -= bytes;
+    }
+    return 0;
+}
+
+
+// passes the body of the client's request on as it arrives, framed the
+// way the client framed it, by Content-Length or in chunks, so a body of
+// any size goes through without being held in memory
+// returns 0 once all of it has been sent, -1 if it was cut short
+static int send_request_body(rio_t *client, int clientfd, int serverfd,
+                             char *header){
+    char buffer[MAXLINE];
+    char *end;
+    long length = 0;
+    int bytes;
+
+    if(!http_field(header, "Transfer-Encoding", buffer, MAXLINE)){
+        if(http_field(header, "Content-Length", buffer, MAXLINE)){
+            length = atol(buffer);
+        }
+        return relay_body(client, clientfd, serverfd, length);
+    }
+
+    // each chunk goes with its size line and the CRLF after its data, the
+    // last one (of size 0) is followed by any trailers and a blank line
+    do{
+        bytes = p_Rio_readlineb(serverfd, clientfd, client, buffer,
+                                MAXLINE);
+        if(bytes <= 0 || buffer[bytes-1] != '\n') return -1;
+        length = strtol(buffer, &end, 16);
+        if(end == buffer || length < 0) return -1;
+        p_Rio_writen(serverfd, clientfd, buffer, bytes);
+        if(length > 0 &&
+           relay_body(client, clientfd, serverfd, length + 2) < 0){
+            return -1;
+        }
+    }while(length > 0);
+
+    while((bytes = p_Rio_readlineb(serverfd, clientfd, client, buffer,
+                                   MAXLINE)) > 0){
+        p_Rio_writen(serverfd, clientfd, buffer, bytes);
+        if(bytes == 1 || (bytes == 2 && buffer[0] == '\r')) return 0;
+    }
+    return -1;
+}
+
+
+// whether a method only reads what it is sent to, rather than changing it
+static int safe_method(char *method){
+    return !strcmp(method, "GET") || !strcmp(method, "HEAD") ||
+           !strcmp(method, "OPTIONS") || !strcmp(method, "TRACE");
+}
+
+
+int pass_request(int clientfd, rio_t *client, char *method, char *hostname,
+                 char *path, int port, int route, char *header,
+                 url_key cache_key, stage_timer *timer){
+    static const char *go_on = "HTTP/1.1 100 Continue\r\n\r\n";
+    char head[MAX_HEADER_SIZE];
+    char buffer[MAXLINE];
+    char backend_host[MAXLINE];
+    char *fetch_host;
+    int fetch_port;
+    int serverfd;
+    int head_len = -1;
+    int admitted;
+    int origin;
+    int status = 0;
+    int chunked;
+    int used;
+    long total;
+    long bytes = 0;
+    http_body body;
+    rio_t server;
+
+    admitted = enter_upstream(route, hostname, port, backend_host,
+                              &fetch_host, &fetch_port, &origin);
+    if(admitted != ORIGIN_OK) return admitted;
+    stats_inc(STAT_PASSED);
+    if(upstream_request(method, fetch_host, hostname, path, fetch_port,
+                        header, &serverfd, &server, clientfd, NULL) != 0){
+        origin_leave(origin, 0);
+        stats_inc(STAT_UPSTREAM_ERRORS);
+        return -1;
+    }
+    timer_stage(timer, STAGE_CONNECT);
+
+    // a client waiting to hear it may send its body is told so here,
+    // rather than after a round trip to the server
+    if(http_field(header, "Expect", buffer, MAXLINE) &&
+       strcasecmp(buffer, "100-continue") == 0 &&
+       rio_writen(clientfd, (void *)go_on, strlen(go_on)) > 0){
+        client_sent(strlen(go_on));
+    }
+
+    // the body is bounded by the transfer deadline, not the upstream one
+    watch_set(WATCH_TRANSFER, serverfd);
+    if(send_request_body(client, clientfd, serverfd, header) == 0){
+        watch_set(WATCH_UPSTREAM, serverfd);
+
+        // informational responses (such as another 100 Continue) come
+        // ahead of the real one, only HTTP/1.1 clients are sent them
+        while((head_len = read_response_head(&server, serverfd, clientfd,
+                                             head)) > 0 &&
+              (status = http_status(head)) >= 100 && status < 200){
+            if(client_chunks){
+                p_Rio_writen(clientfd, serverfd, head, head_len);
+                client_sent(head_len);
+            }
+        }
+    }
+    timer_stage(timer, STAGE_FIRST_BYTE);
+    PROBE1(upstream__first__byte, head_len);
+    if(head_len < 0){
+        close_server(serverfd);
+        origin_leave(origin, 0);
+        stats_inc(STAT_UPSTREAM_ERRORS);
+        return -1;
+    }
+
+    watch_set(WATCH_TRANSFER, serverfd);
+    http_body_init(&body, head, head_len, !strcmp(method, "HEAD"));
+    chunked = client_chunks && body.framing == HTTP_CHUNKED;
+    relay_head(clientfd, serverfd, head, head_len, &body);
+    if(log_entry != NULL) log_entry->status = status;
+    total = head_len;
+    while(!body.done && (bytes = read_some(&server, buffer, MAXLINE)) > 0){
+        total += bytes;
+        if((bytes = http_body_decode(&body, buffer, bytes, &used)) < 0){
+            break;
+        }
+        relay_piece(clientfd, serverfd, buffer, bytes, chunked);
+    }
+    if(chunked && body.done) relay_end(clientfd, serverfd);
+    stats_add(STAT_UPSTREAM_BYTES, total);
+    timer_stage(timer, STAGE_RELAY);
+    close_server(serverfd);
+    origin_leave(origin, bytes >= 0 && !timed_out() &&
+                         (body.done || body.framing == HTTP_CLOSE));
+
+    if(!safe_method(method) && status < 400){
+        cache_w_lock(p_cache);
+        cache_invalidate(p_cache, cache_key.hash, cache_key.check);
+        cache_w_unlock(p_cache);
+    }
+    return ORIGIN_OK;
+}
+
+
+// answers a range request whose response didn't come whole with a 502,
+// or a 504 if the server ran out of time, returns -1
+static int range_failed(int clientfd){
+    static const char *bad_gateway = "HTTP/1.0 502 Bad Gateway\r\n"
+                                     "Content-Length: 0\r\n\r\n";
+    static const char *gateway_timeout = "HTTP/1.0 504 Gateway Timeout\r\n"
+                                         "Content-Length: 0\r\n\r\n";
+    const char *error = timed_out() ? gateway_timeout : bad_gateway;
+
+    if(log_entry != NULL){
+        log_entry->result = LOG_ERROR;
+        log_entry->status = timed_out() ? 504 : 502;
+    }
+    client_writen(clientfd, (void *)error, strlen(error));
+    return -1;
+}
+
+
+int respond_to_client(rio_t *server, int serverfd, int clientfd,
+                      url_key cache_key, char *header, char *ranges,
+                      char *head, int head_len){
 
     char buffer[MAXLINE];
     char cache_data[MAX_OBJECT_SIZE];
+    char packed[MAX_HEADER_SIZE];
     char *ptr = cache_data;
     int offset = 0;
+    int packed_len;
     int bytes = 0;
+    int cacheable;
+    int relay;
+    int chunked;
+    int used;
+    long total = head_len;
+    http_body body;
+    meta m;
+
+    // only a whole response can have ranges cut out of it, other responses
+    // to a range request are passed on untouched
+    cacheable = get_cache_meta(head, head_len, &m);
+    if(cacheable && http_field(header, "Authorization", buffer, MAXLINE) &&
+       !(http_header(head, head_len, "Cache-Control", buffer, MAXLINE) &&
+         (http_cc_directive(buffer, "public", NULL) ||
+          http_cc_directive(buffer, "s-maxage", NULL) ||
+          http_cc_directive(buffer, "must-revalidate", NULL)))){
+        // a response to an authorized request is meant for that user,
+        // unless the origin says other users may be given it too
+        cacheable = 0;
+    }
+    if(http_status(head) != 200) ranges = NULL;
+    if(ranges != NULL &&
+       http_header(head, head_len, "Content-Length", buffer, MAXLINE) &&
+       head_len + atol(buffer) >= MAX_OBJECT_SIZE){
+        return 1;
+    }
 
-    bzero(buffer, MAXLINE);
-
-    // read data from the server
-    while((bytes = rio_readnb(server, buffer, MAXLINE)) > 0){
-        p_Rio_writen(clientfd, serverfd, buffer, bytes);
+    // the head has already been read, pass it on first
+    // background refreshes have no client and only fill the cache
+    http_body_init(&body, head, head_len, 0);
+    relay = (clientfd >= 0 && ranges == NULL);
+    chunked = client_chunks && body.framing == HTTP_CHUNKED;
+    if(relay) relay_head(clientfd, serverfd, head, head_len, &body);
+    memcpy(ptr, head, head_len);
+    offset = head_len;
+
+    // read data from the server up to the end of the response, the body
+    // is kept and passed on decoded from its framing
+    while(!body.done && (bytes = read_some(server, buffer, MAXLINE)) > 0){
+        total += bytes;
+        if((bytes = http_body_decode(&body, buffer, bytes, &used)) < 0){
+            break;
+        }
+        if(relay) relay_piece(clientfd, serverfd, buffer, bytes, chunked);
 
         // attempt to save data for cache
         if(offset+bytes < MAX_OBJECT_SIZE){
             memcpy(ptr+offset, buffer, bytes);
         }
+        else if(ranges != NULL) return 1;
         offset += bytes;
-        bzero(buffer, MAXLINE);
     }
-    if(bytes == -1) return; // failed reading from server
+    stats_add(STAT_UPSTREAM_BYTES, total);
+
+    // a response that ended early must not be cached, a chunked one is
+    // only ended for the client if it came whole, and a client waiting
+    // for a range cut from it is told it isn't coming
+    if(bytes < 0 || timed_out() ||
+       (!body.done && body.framing != HTTP_CLOSE)){
+        if(ranges != NULL && clientfd >= 0) return range_failed(clientfd);
+        return 0;
+    }
+    if(relay && chunked) relay_end(clientfd, serverfd);
+
+    // with the doorkeeper on, a response is only cached on its URL's
+    // second miss, background refreshes are of objects already cached
+    // prefetches are let in on their first fetch on purpose, otherwise
+    // they would only ever warm the filter, what they can bring in is
+    // bounded instead by PREFETCH_LINKS a page and the host's budget (-e)
+    if(cacheable && door != NULL && clientfd >= 0 &&
+       offset < MAX_OBJECT_SIZE && !bloom_admit(door, cache_key.hash)){
+        stats_inc(STAT_DOOR_DECLINED);
+        cacheable = 0;
+    }
+
+    // the head is parsed once here, hits only have to write it back out,
+    // and the body is kept apart from it, stored decoded
+    if(offset >= MAX_OBJECT_SIZE || (!cacheable && ranges == NULL)){
+        return 0;
+    }
+    packed_len = pack_head(packed, head, head_len, offset - head_len);
+    if(packed_len < 0 || packed_len + offset - head_len >= MAX_OBJECT_SIZE){
+        return ranges != NULL;
+    }
+
+    // the client is about to ask for what a page embeds, so fetch that into
+    // the cache ahead of it, the body is scanned before it is compressed
+    if(cacheable && prefetching && miss_target != NULL &&
+       http_header(head, head_len, "Content-Type", buffer, MAXLINE) &&
+       !strncasecmp(buffer, "text/html", strlen("text/html")) &&
+       !http_header(head, head_len, "Content-Encoding", buffer, MAXLINE)){
+        prefetch_page(miss_target->hostname, miss_target->port,
+                      miss_target->path, header, cache_data + head_len,
+                      offset - head_len);
+    }
 
     // cache the data received from the server
-    if(offset < MAX_OBJECT_SIZE && offset > 0){
-        cache_w_lock();
-        cache_add(p_cache, cache_key, cache_data, offset);
-        cache_w_unlock();
+    if(cacheable){
+        offset = compress_body(cache_data, offset, head_len, &m);
+
+        // marked so that its first hit is put down to prefetching
+        m.prefetched = prefetch_fetch;
+        if(prefetch_fetch) stats_inc(STAT_PREFETCHES);
+        cache_w_lock(p_cache);
+        cache_add(p_cache, cache_key.hash, cache_key.check,
+                  key_variant(m.vary, header), packed, packed_len,
+                  cache_data + head_len, offset - head_len, &m);
+        cache_w_unlock(p_cache);
+    }
+    if(ranges != NULL){
+        serve_object(clientfd, packed, packed_len, cache_data + head_len,
+                     offset - head_len, &m, header, ranges, 0);
+    }
+    return 0;
+}
+
+
+int compress_body(char *data, int size, int head_len, meta *m){
+    char zipped[MAX_OBJECT_SIZE];
+    char value[MAXLINE];
+    int body_len = size - head_len;
+    int len;
+
+    if(zip_level == 0 || body_len < ZIP_MIN_SIZE) return size;
+
+    // already encoded bodies and binary formats won't compress any further
+    if(http_header(data, head_len, "Content-Encoding", value, MAXLINE)){
+        return size;
+    }
+    if(!http_header(data, head_len, "Content-Type", value, MAXLINE)){
+        return size;
+    }
+    if(strncasecmp(value, "text/", strlen("text/")) &&
+       strncasecmp(value, "application/javascript", 22) &&
+       strncasecmp(value, "application/json", 16) &&
+       strncasecmp(value, "application/xml", 15) &&
+       !strstr(value, "+xml") && !strstr(value, "+json")){
+        return size;
+    }
+
+    // keep the original unless compressing saves at least an eighth
+    len = zip_compress(data + head_len, body_len, zipped,
+                       body_len - body_len/8, zip_level);
+    if(len < 0) return size;
+
+    memcpy(data + head_len, zipped, len);
+    m->gzipped = 1;
+    return head_len + len;
+}
+
+
+// generates the head to send for a stored response from its packed head,
+// with the status line replaced if status isn't NULL, the fields in drop
+// left out and those in extra added, a hit also gets how long ago the
+// origin sent it and that it came from the cache
+// returns its length, or -1 if it doesn't fit in MAX_HIT_HEAD
+static int hit_head(char *dst, char *head, int head_len, meta *m, int hit,
+                    const char *status, const char **drop, char *extra){
+    char fields[MAXLINE + 64];
+    long age = time(NULL) - m->born;
+    int n = 0;
+
+    if(hit){
+        n = sprintf(fields, "Age: %ld\r\nX-Cache: HIT\r\n",
+                    (age > 0) ? age : 0);
+    }
+    snprintf(&fields[n], sizeof(fields) - n, "%s", extra);
+    return http_unpack_head(dst, MAX_HIT_HEAD, head, head_len, status, drop,
+                            fields);
+}
+
+
+// generates the head of a compressed object, labelled for a client that
+// takes it compressed (zipped_len is the compressed body's length) or for
+// one that gets it decompressed (zipped_len is -1)
+static int zip_head(char *dst, char *head, int head_len, meta *m, int hit,
+                    long zipped_len){
+    static const char *drop[] = {"Vary", NULL};
+    static const char *drop_zip[] = {"Vary", "Content-Length", "ETag", NULL};
+    char vary[MAXLINE/2];
+    char extra[MAXLINE];
+    int len = strlen(m->etag);
+    int n = 0;
+
+    // either way the encoding depends on the client's Accept-Encoding
+    if(http_packed_field(head, head_len, "Vary", vary, MAXLINE/2)){
+        n = sprintf(extra, "Vary: %s, Accept-Encoding\r\n", vary);
+    }
+    else{
+        n = sprintf(extra, "Vary: Accept-Encoding\r\n");
+    }
+    if(zipped_len >= 0){
+        n += sprintf(&extra[n], "Content-Encoding: gzip\r\n"
+                     "Content-Length: %ld\r\n", zipped_len);
+        // the origin's tag is for the bytes it sent, the compressed ones
+        // are another representation and get a tag of their own
+        if(len > 1 && m->etag[len-1] == '"'){
+            sprintf(&extra[n], "ETag: %.*s-gzip\"\r\n", len - 1, m->etag);
+        }
+    }
+    return hit_head(dst, head, head_len, m, hit, NULL,
+                    (zipped_len >= 0) ? drop_zip : drop, extra);
+}
+
+
+// writes a generated head and len bytes of the stored body after it, with
+// a single system call where the socket takes it, the body isn't copied
+// a large body in a file backed cache is sent from the file instead
+static void send_head_body(int clientfd, char *head, int head_len,
+                           char *body, long len){
+    struct iovec iov[2];
+    off_t offset;
+
+    if(head_len < 0) return;
+    if(len >= SENDFILE_MIN &&
+       (offset = cache_file_offset(p_cache, body)) >= 0){
+        client_sendfile(clientfd, head, head_len, p_cache->fd, offset, len);
+        return;
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
+    client_writev(clientfd, iov, 2);
+}
+
+
+// returns 1 if the client's If-Range (if any) matches the stored response,
+// meaning the range may be served, a mismatch gets the whole response
+// ranges are only cut from the body as the origin sent it, so a tag given
+// out for the compressed body never matches here
+static int if_range_matches(char *ranges, meta *m){
+    char value[MAXLINE];
+
+    if(!http_field(ranges, "If-Range", value, MAXLINE)) return 1;
+
+    // entity tags need a strong comparison, weak ones never match
+    if(value[0] == '"') return !strcmp(value, m->etag);
+    if(value[0] == 'W' && value[1] == '/') return 0;
+    return m->last_modified[0] != '\0' && !strcmp(value, m->last_modified);
+}
+
+
+void serve_object(int clientfd, char *head, int head_len, char *body,
+                  int body_len, meta *m, char *header, char *ranges, int hit){
+    static const char *drop[] = {"Content-Length", "Content-Range", NULL};
+    static const char *drop_multi[] = {"Content-Length", "Content-Range",
+                                       "Content-Type", NULL};
+    char spec[MAXLINE];
+    char type[MAXLINE];
+    char extra[MAXLINE];
+    char out[MAX_HIT_HEAD];
+    char parts[MAX_RANGES][MAX_PART_HEAD];
+    char closing[MAX_PART_HEAD];
+    struct iovec iov[2*MAX_RANGES + 2];
+    http_range range[MAX_RANGES];
+    char *plain;
+    meta plain_meta;
+    long total;
+    int count;
+    int len;
+    int i;
+
+    if(m->gzipped){
+        // whole objects are sent compressed or decompressed on the fly
+        if(ranges == NULL){
+            if(http_field(header, "Accept-Encoding", spec, MAXLINE) &&
+               http_accepts(spec, "gzip")){
+                len = zip_head(out, head, head_len, m, hit, body_len);
+                send_head_body(clientfd, out, len, body, body_len);
+            }
+            else if((len = zip_head(out, head, head_len, m, hit, -1)) > 0 &&
+                    client_writen(clientfd, out, len) == len){
+                len = zip_write(clientfd, body, body_len);
+                if(len > 0) client_sent(len);
+            }
+            return;
+        }
+
+        // ranges refer to the decompressed body, so cut them out of that
+        plain = Malloc(MAX_OBJECT_SIZE);
+        len = zip_decompress(body, body_len, plain, MAX_OBJECT_SIZE);
+        if(len >= 0){
+            plain_meta = *m;
+            plain_meta.gzipped = 0;
+            serve_object(clientfd, head, head_len, plain, len, &plain_meta,
+                         header, ranges, hit);
+        }
+        Free(plain);
+        return;
+    }
+
+    // without a usable Range the object is sent whole
+    if(ranges == NULL || !http_field(ranges, "Range", spec, MAXLINE) ||
+       !if_range_matches(ranges, m) ||
+       (count = http_ranges(spec, body_len, range, MAX_RANGES)) < 0){
+        len = hit_head(out, head, head_len, m, hit, NULL, NULL, "");
+        send_head_body(clientfd, out, len, body, body_len);
+        return;
+    }
+
+    if(count == 0){
+        len = sprintf(out, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                      "Content-Range: bytes */%d\r\n"
+                      "Content-Length: 0\r\n\r\n", body_len);
+        client_writen(clientfd, out, len);
+        return;
+    }
+
+    if(count == 1){
+        sprintf(extra, "Content-Range: bytes %ld-%ld/%d\r\n"
+                "Content-Length: %ld\r\n", range[0].first, range[0].last,
+                body_len, range[0].last - range[0].first + 1);
+        len = hit_head(out, head, head_len, m, hit,
+                       "HTTP/1.1 206 Partial Content", drop, extra);
+        send_head_body(clientfd, out, len, body + range[0].first,
+                       range[0].last - range[0].first + 1);
+        return;
+    }
+
+    // several ranges go out as a multipart/byteranges body, each part
+    // labelled with the object's own type, its length is worked out up
+    // front so the connection can be kept open after it
+    if(!http_packed_field(head, head_len, "Content-Type", type, MAXLINE)){
+        strcpy(type, "application/octet-stream");
+    }
+    total = 0;
+    for(i = 0; i < count; i++){
+        len = snprintf(parts[i], MAX_PART_HEAD, "\r\n--%s\r\n"
+                       "Content-Type: %.200s\r\n"
+                       "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+                       RANGE_BOUNDARY, type, range[i].first, range[i].last,
+                       body_len);
+        if(len >= MAX_PART_HEAD) len = MAX_PART_HEAD - 1;
+        iov[2*i + 1].iov_base = parts[i];
+        iov[2*i + 1].iov_len = len;
+        iov[2*i + 2].iov_base = body + range[i].first;
+        iov[2*i + 2].iov_len = range[i].last - range[i].first + 1;
+        total += iov[2*i + 1].iov_len + iov[2*i + 2].iov_len;
+    }
+    len = sprintf(closing, "\r\n--%s--\r\n", RANGE_BOUNDARY);
+    iov[2*count + 1].iov_base = closing;
+    iov[2*count + 1].iov_len = len;
+    total += len;
+
+    sprintf(extra, "Content-Type: multipart/byteranges; boundary=%s\r\n"
+            "Content-Length: %ld\r\n", RANGE_BOUNDARY, total);
+    len = hit_head(out, head, head_len, m, hit,
+                   "HTTP/1.1 206 Partial Content", drop_multi, extra);
+    if(len < 0) return;
+    iov[0].iov_base = out;
+    iov[0].iov_len = len;
+    client_writev(clientfd, iov, 2*count + 2);
+    return;
+}
+
+
+void open_tunnel(int clientfd, rio_t *client, char *hostname, int port){
+    static const char *established =
+        "HTTP/1.1 200 Connection Established\r\n\r\n";
+    static const char *failed = "HTTP/1.0 502 Bad Gateway\r\n"
+                                "Content-Length: 0\r\n\r\n";
+    long sent = 0;
+    long received = 0;
+    int serverfd;
+    int end;
+
+    // a tunnel may well last longer than any request
+    if(conn_watch != NULL) deadline_cancel(&conn_watch->d);
+
+    PROBE2(upstream__connect__start, hostname, port);
+    serverfd = open_clientfd_t(hostname, port,
+                               timeouts[WATCH_UPSTREAM] * 1000);
+    stats_inc(STAT_UPSTREAM_CONNECTS);
+    PROBE1(upstream__connect__done, serverfd);
+    if(serverfd < 0){
+        stats_inc(STAT_UPSTREAM_CONNECT_ERRORS);
+        if(log_entry != NULL) log_entry->result = LOG_ERROR;
+        client_writen(clientfd, (void *)failed, strlen(failed));
+        return;
+    }
+    stats_inc(STAT_TUNNELS);
+    if(log_entry != NULL) log_entry->result = LOG_TUNNEL;
+    client_writen(clientfd, (void *)established, strlen(established));
+
+    // the client may not have waited for the answer before starting on
+    // whatever it tunnels, what it sent is still in the read buffer
+    if(client->rio_cnt > 0){
+        p_Rio_writen(serverfd, clientfd, client->rio_bufptr, client->rio_cnt);
+        sent = client->rio_cnt;
+        client->rio_cnt = 0;
+    }
+
+    end = tunnel_relay(clientfd, serverfd, tunnel_idle, &sent, &received);
+    Close(serverfd);
+    if(end == TUNNEL_IDLE_OUT) stats_inc(STAT_TUNNEL_IDLE);
+    stats_add(STAT_TUNNEL_SENT_BYTES, sent);
+    stats_add(STAT_TUNNEL_RECEIVED_BYTES, received);
+    stats_add(STAT_UPSTREAM_BYTES, received);
+    client_sent(received);
+    PROBE2(tunnel__done, sent, received);
+    return;
+}
+
+
+void serve_head(int clientfd, char *head, int head_len, int body_len,
+                meta *m, char *header){
+    char spec[MAXLINE];
+    char out[MAX_HIT_HEAD];
+    int len;
+
+    // labelled for the encoding the body would be sent in
+    if(m->gzipped){
+        len = zip_head(out, head, head_len, m, 1,
+                       (http_field(header, "Accept-Encoding", spec,
+                                   MAXLINE) &&
+                        http_accepts(spec, "gzip")) ? body_len : -1);
+    }
+    else{
+        len = hit_head(out, head, head_len, m, 1, NULL, NULL, "");
     }
+    if(len > 0) client_writen(clientfd, out, len);
     return;
 }
 
 
-void cache_r_lock(){
-    P(&mutex);
-    readcnt++;
-    if(readcnt == 1) P(&w);
-    V(&mutex);
+int get_cache_meta(char *head, int head_len, meta *m){
+    char value[MAXLINE];
+    time_t now = time(NULL);
+    time_t date = now;
+    time_t expires;
+    time_t modified;
+    long age;
+    long stale_while = 0;
+    long stale_error = DEFAULT_STALE_IF_ERROR;
+    int cacheable = 1;
+
+    m->expires = now + DEFAULT_TTL;
+    m->etag[0] = '\0';
+    m->last_modified[0] = '\0';
+    m->vary[0] = '\0';
+    m->gzipped = 0;
+    m->prefetched = 0;
+
+    // the response may have spent a while in caches before this one
+    m->born = now;
+    if(http_header(head, head_len, "Age", value, MAXLINE) &&
+       (age = atol(value)) > 0){
+        m->born = now - age;
+    }
+
+    // only complete responses are worth keeping
+    if(http_status(head) != 200) cacheable = 0;
+
+    // a truncated validator would never match, so don't keep it
+    if(http_header(head, head_len, "ETag", m->etag, MAX_VALIDATOR) &&
+       strlen(m->etag) == MAX_VALIDATOR-1){
+        m->etag[0] = '\0';
+    }
+    if(http_header(head, head_len, "Last-Modified", m->last_modified,
+                   MAX_VALIDATOR) &&
+       strlen(m->last_modified) == MAX_VALIDATOR-1){
+        m->last_modified[0] = '\0';
+    }
+    // each variant of the response gets its own cache entry, unless it
+    // varies on something other than headers (Vary: *)
+    if(http_header(head, head_len, "Vary", value, MAXLINE) &&
+       key_vary(m->vary, MAX_VARY, value) < 0){
+        m->vary[0] = '\0';
+        cacheable = 0;
+    }
+    if(http_header(head, head_len, "Date", value, MAXLINE) &&
+       http_date(value) != -1){
+        date = http_date(value);
+    }
+
+    // Cache-Control takes priority over Expires, which takes priority over
+    // guessing from how long ago the object was last modified
+    if(http_header(head, head_len, "Cache-Control", value, MAXLINE)){
+        if(http_cc_directive(value, "no-store", NULL)) cacheable = 0;
+        if(http_cc_directive(value, "private", NULL)) cacheable = 0;
+
+        if(http_cc_directive(value, "s-maxage", &age) ||
+           http_cc_directive(value, "max-age", &age)){
+            m->expires = now + age;
+        }
+        if(http_cc_directive(value, "no-cache", NULL)) m->expires = now;
+
+        http_cc_directive(value, "stale-while-revalidate", &stale_while);
+        http_cc_directive(value, "stale-if-error", &stale_error);
+        if(http_cc_directive(value, "must-revalidate", NULL) ||
+           http_cc_directive(value, "proxy-revalidate", NULL)){
+            stale_while = 0;
+            stale_error = 0;
+        }
+    }
+    else if(http_header(head, head_len, "Expires", value, MAXLINE)){
+        // an invalid date means the response is already stale
+        expires = http_date(value);
+        m->expires = (expires == -1) ? now : now + (expires - date);
+    }
+    else if(m->last_modified[0] != '\0' &&
+            (modified = http_date(m->last_modified)) != -1 &&
+            modified < date){
+        m->expires = now + (date - modified) / 10;
+    }
+    m->stale_while = m->expires + stale_while;
+    m->stale_error = m->expires + stale_error;
+    return cacheable;
+}
+
+
+object* find_cached(url_key cache_key, char *header){
+    const char *vary;
+
+    // both hashes of the URL must match, one alone may be another URL's
+    vary = cache_vary(p_cache, cache_key.hash, cache_key.check);
+    if(vary == NULL) return NULL;
+    return cache_lookup(p_cache, cache_key.hash, cache_key.check,
+                        key_variant(vary, header));
+}
+
+
+void refresh_cached(url_key cache_key, char *header,
+                    char *head, int head_len){
+    char merged[MAX_HEADER_SIZE];
+    char packed[MAX_HEADER_SIZE];
+    object* cache_obj;
+    char *body;
+    int body_size;
+    int packed_len;
+    int len;
+    int cacheable;
+    meta fresh;
+
+    cache_w_lock(p_cache);
+    cache_obj = find_cached(cache_key, header);
+    if(cache_obj == NULL){
+        cache_w_unlock(p_cache);
+        return;
+    }
+
+    // a 304 only has to send the fields that changed, the object's
+    // freshness comes from the stored head brought up to date with them,
+    // and it is as old as the 304
+    len = merge_head(merged, cache_obj, head, head_len);
+    cacheable = (len > 0) && get_cache_meta(merged, len, &fresh);
+    if(cacheable &&
+       (packed_len = http_pack_head(packed, MAX_HEADER_SIZE, merged,
+                                    len)) > 0){
+        strcpy(fresh.vary, cache_obj->meta.vary);
+        fresh.gzipped = cache_obj->meta.gzipped;
+        fresh.prefetched = cache_obj->meta.prefetched;
+
+        // the body is stored right after the head, whose size may have
+        // changed, so the object is added again
+        body_size = object_body_size(cache_obj);
+        body = Malloc(body_size + 1);
+        memcpy(body, object_body(cache_obj), body_size);
+        cache_add(p_cache, cache_key.hash, cache_key.check,
+                  cache_obj->variant, packed, packed_len, body, body_size,
+                  &fresh);
+        Free(body);
+    }
+    else{
+        // the update can't be kept, or forbids keeping the object at all
+        cache_invalidate(p_cache, cache_key.hash, cache_key.check);
+    }
+    cache_w_unlock(p_cache);
     return;
 }
 
 
-void cache_r_unlock(){
-    P(&mutex);
-    readcnt--;
-    if(readcnt == 0) V(&w);
-    V(&mutex);
+int serve_cached(int clientfd, url_key cache_key, char *header,
+                 char *ranges){
+    object* cache_obj;
+    int served = 0;
+
+    cache_r_lock(p_cache);
+    cache_obj = find_cached(cache_key, header);
+    if(cache_obj != NULL){
+        serve_object(clientfd, object_data(cache_obj), cache_obj->head_size,
+                     object_body(cache_obj), object_body_size(cache_obj),
+                     &cache_obj->meta, header, ranges, 1);
+        served = 1;
+    }
+    cache_r_unlock(p_cache);
+    return served;
+}
+
+
+void start_refresh(char *hostname, char *path, int port, char *header,
+                   url_key cache_key, meta *validators){
+    pthread_t tid;
+    object* cache_obj;
+    refresh_job *job = Malloc(sizeof(refresh_job));
+
+    strcpy(job->hostname, hostname);
+    strcpy(job->path, path);
+    strcpy(job->header, header);
+    job->cache_key = cache_key;
+    job->port = port;
+    job->validators = *validators;
+
+    // failing to refresh shouldn't take the proxy down, the next request
+    // for the object will try again
+    if(pthread_create(&tid, NULL, refresh_thread, (void *)job) != 0){
+        cache_w_lock(p_cache);
+        cache_obj = find_cached(cache_key, header);
+        if(cache_obj != NULL) cache_obj->refreshing = 0;
+        cache_w_unlock(p_cache);
+        Free(job);
+    }
+    return;
+}
+
+
+// runs when a refresh finishes, including when it exits through one of the
+// p_Rio wrappers, so that the object can be refreshed again later
+static void refresh_done(void *vargp){
+    refresh_job *job = (refresh_job *)vargp;
+    object* cache_obj;
+
+    cache_w_lock(p_cache);
+    cache_obj = find_cached(job->cache_key, job->header);
+    if(cache_obj != NULL) cache_obj->refreshing = 0;
+    cache_w_unlock(p_cache);
+    Free(job);
+}
+
+
+// gives a refresh or prefetch the deadlines of a connection, with no client
+// to cut off, so that a server that stalls can't keep the thread forever
+static void background_watch(watch *w){
+    memset(w, 0, sizeof(*w));
+    w->d.fire = watch_fired;
+    w->clientfd = -1;
+    w->serverfd = -1;
+    conn_watch = w;
+    watch_set(WATCH_TRANSFER, -1);
+}
+
+
+// runs when a refresh or prefetch ends, including through the p_Rio wrappers
+static void background_unwatch(void *vargp){
+    watch *w = (watch *)vargp;
+
+    deadline_cancel(&w->d);
+    conn_watch = NULL;
+}
+
+
+// sends a GET for hostname:port's path with no client waiting on it, for
+// refreshes and prefetches, to the origin or, in a reverse proxy, one of
+// the site's backends, returns the length of the response head read into
+// head, or -1 if none came
+// on success the caller closes serverfd and leaves origin
+static int background_request(char *hostname, int port, char *path,
+                              char *header, meta *validators, int *serverfd,
+                              rio_t *server, int *origin, char *head){
+    char backend_host[MAXLINE];
+    char *host = hostname;
+    int head_len = -1;
+    int route;
+
+    // a reverse proxy asks one of the site's backends
+    if(reverse){
+        host = backend_host;
+        if((route = backend_route(hostname, path)) < 0 ||
+           backend_pick(route, backend_host, MAXLINE, &port) < 0){
+            return -1;
+        }
+    }
+
+    // there is no client to answer, so -1 stands in for its descriptor
+    // an origin that isn't taking requests is left alone until next time
+    *origin = -1;
+    if(origin_enter(host, port, origin) == ORIGIN_OK &&
+       upstream_request("GET", host, hostname, path, port, header,
+                        serverfd, server, -1, validators) == 0){
+        if((head_len = read_response_head(server, *serverfd, -1,
+                                          head)) > 0){
+            return head_len;
+        }
+        watch_set(WATCH_TRANSFER, -1);
+        Close(*serverfd);
+    }
+    if(*origin >= 0) origin_leave(*origin, 0);
+    return -1;
+}
+
+
+void *refresh_thread(void *vargp){
+    refresh_job *job = (refresh_job *)vargp;
+    char head[MAX_HEADER_SIZE];
+    int head_len;
+    int serverfd;
+    int status;
+    int origin;
+    rio_t server;
+    watch timeout;
+
+    Pthread_detach(Pthread_self());
+    pthread_cleanup_push(refresh_done, job);
+    background_watch(&timeout);
+    pthread_cleanup_push(background_unwatch, &timeout);
+
+    head_len = background_request(job->hostname, job->port, job->path,
+                                  job->header, &job->validators, &serverfd,
+                                  &server, &origin, head);
+    if(head_len > 0){
+        status = http_status(head);
+        if(status == 304){
+            refresh_cached(job->cache_key, job->header, head, head_len);
+        }
+        else if(status == 200){
+            respond_to_client(&server, serverfd, -1, job->cache_key,
+                              job->header, NULL, head, head_len);
+        }
+        // anything else leaves the stale copy to stand in for the server
+        // until its stale-if-error window closes
+        watch_set(WATCH_TRANSFER, -1);
+        Close(serverfd);
+        origin_leave(origin, !timed_out());
+    }
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+
+void prefetch_link(char *hostname, int port, char *path, char *header){
+    char head[MAX_HEADER_SIZE];
+    url_key cache_key = key_request(hostname, port, path);
+    object* cache_obj;
+    int head_len;
+    int serverfd;
+    int origin;
+    rio_t server;
+    watch timeout;
+
+    cache_r_lock(p_cache);
+    cache_obj = find_cached(cache_key, header);
+    cache_r_unlock(p_cache);
+    if(cache_obj != NULL) return;
+
+    background_watch(&timeout);
+    pthread_cleanup_push(background_unwatch, &timeout);
+    head_len = background_request(hostname, port, path, header, NULL,
+                                  &serverfd, &server, &origin, head);
+    if(head_len > 0){
+        if(http_status(head) == 200){
+            prefetch_fetch = 1;
+            respond_to_client(&server, serverfd, -1, cache_key, header,
+                              NULL, head, head_len);
+            prefetch_fetch = 0;
+        }
+        watch_set(WATCH_TRANSFER, -1);
+        Close(serverfd);
+        origin_leave(origin, !timed_out());
+    }
+    pthread_cleanup_pop(1);
     return;
 }
 
 
-void inline cache_w_lock(){
-    P(&w);
+
+// sets up a newly forked worker, which leaves reporting at shutdown to
+// the parent
+static int worker_started(int i){
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTERM, SIG_DFL);
+    return i;
+}
+
+
+int start_workers(int count){
+    pid_t *pids = worker_pids;
+    pid_t pid;
+    int i;
+
+    worker_count = count;
+    for(i = 0; i < count; i++){
+        if((pids[i] = Fork()) == 0) return worker_started(i);
+    }
+
+    // a worker that crashed may have been holding the cache's lock, hand
+    // its part back before a replacement takes its place
+    while(1){
+        if((pid = waitpid(-1, NULL, 0)) < 0){
+            if(errno == EINTR) continue;
+            unix_error("waitpid error");
+        }
+        for(i = 0; i < count && pids[i] != pid; i++);
+        if(i == count) continue;
+
+        fprintf(stderr, "worker %d (pid %d) exited, restarting it\n",
+                i, (int)pid);
+        cache_reap(p_cache, i);
+        if((pids[i] = Fork()) == 0) return worker_started(i);
+    }
+}
+
+
+void shutdown_proxy(int sig){
+    static char table[MAXLINE];
+    int len;
+    int i;
+
+    for(i = 0; i < worker_count; i++) kill(worker_pids[i], SIGTERM);
+
+    // snprintf isn't async-signal-safe, but nothing else runs in the
+    // handler and the process exits right after
+    if((len = stats_write_table(table, MAXLINE)) > 0){
+        write(STDERR_FILENO, table, len);
+    }
+    _exit(0);
 }
 
 
-void inline cache_w_unlock(){
-    V(&w);
+// appends the cache's own figures to the counters, as gauges apart from
+// the insertions and evictions
+static int write_cache_metrics(char *buf, int size){
+    size_t bytes, objects, capacity;
+    unsigned long insertions, evictions;
+
+    cache_r_lock(p_cache);
+    bytes = p_cache->size;
+    objects = p_cache->objects;
+    capacity = p_cache->capacity;
+    insertions = p_cache->insertions;
+    evictions = p_cache->evictions;
+    cache_r_unlock(p_cache);
+
+    return snprintf(buf, size,
+        "# HELP proxy_cache_bytes Bytes of responses held in the cache.\n"
+        "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %lu\n"
+        "# HELP proxy_cache_capacity_bytes Most bytes the cache holds.\n"
+        "# TYPE proxy_cache_capacity_bytes gauge\n"
+        "proxy_cache_capacity_bytes %lu\n"
+        "# HELP proxy_cache_objects Responses held in the cache.\n"
+        "# TYPE proxy_cache_objects gauge\nproxy_cache_objects %lu\n"
+        "# HELP proxy_cache_insertions_total Responses added to the cache.\n"
+        "# TYPE proxy_cache_insertions_total counter\n"
+        "proxy_cache_insertions_total %lu\n"
+        "# HELP proxy_cache_evictions_total Responses evicted for space.\n"
+        "# TYPE proxy_cache_evictions_total counter\n"
+        "proxy_cache_evictions_total %lu\n"
+        "# HELP proxy_active_connections Client connections open now.\n"
+        "# TYPE proxy_active_connections gauge\n"
+        "proxy_active_connections %lu\n",
+        (unsigned long)bytes, (unsigned long)capacity,
+        (unsigned long)objects, insertions, evictions,
+        stats_total(STAT_CONNECTIONS_OPENED) -
+        stats_total(STAT_CONNECTIONS_CLOSED));
 }
 
+
+// writes the whole /metrics page, returns its length or -1 if it doesn't
+// fit in size
+static int write_metrics(char *buf, int size){
+    int len = 0;
+    int n;
+
+    if((n = stats_write(buf, size)) < 0) return -1;
+    len += n;
+    if((n = write_cache_metrics(buf + len, size - len)) >= size - len){
+        return -1;
+    }
+    len += n;
+    if((n = stats_write_stages(buf + len, size - len)) < 0) return -1;
+    return len + n;
+}
+
+
+void *admin_thread(void *vargp){
+    struct timeval timeout = {ADMIN_TIMEOUT, 0};
+    char buffer[MAXLINE];
+    char head[MAXLINE];
+    char *body = Malloc(METRICS_SIZE);
+    int connfd;
+    int len;
+    int n;
+    rio_t rio;
+
+    Pthread_detach(Pthread_self());
+
+    // scrapes are rare, one at a time is plenty, as long as a connection
+    // that goes quiet can't keep the next one waiting
+    while(1){
+        if((connfd = accept(admin_fd, NULL, NULL)) < 0) continue;
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+        Rio_readinitb(&rio, connfd);
+        if(rio_readlineb(&rio, buffer, MAXLINE) <= 0){
+            close(connfd);
+            continue;
+        }
+        if(strncmp(buffer, "GET /metrics ", strlen("GET /metrics ")) == 0 &&
+           (len = write_metrics(body, METRICS_SIZE)) >= 0){
+            n = sprintf(head, "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %d\r\n\r\n", len);
+            rio_writen(connfd, head, n);
+            rio_writen(connfd, body, len);
+        }
+        else{
+            n = sprintf(head, "HTTP/1.0 404 Not Found\r\n"
+                        "Content-Length: 0\r\n\r\n");
+            rio_writen(connfd, head, n);
+        }
+        close(connfd);
+    }
+    return NULL;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "phist.h"
+#include "pstats.h"
+
+#define CACHE_LINE 64
+
+typedef struct stat_slot
+{
+    unsigned long counts[STAT_COUNT];
+} __attribute__((aligned(CACHE_LINE))) stat_slot;
+
+typedef struct hist_slot
+{
+    hist stages[2][STAGE_COUNT];        // by miss (0) or hit (1), in us
+} __attribute__((aligned(CACHE_LINE))) hist_slot;
+
+typedef struct stat_region
+{
+    unsigned int next_slot;             // handed out round robin
+    stat_slot slots[STATS_SLOTS];
+    hist_slot hists[STATS_HIST_SLOTS];
+} stat_region;
+
+typedef struct stat_info
+{
+    const char* name;
+    const char* type;
+    const char* help;
+} stat_info;
+
+static const stat_info info[STAT_COUNT] = {
+    {"proxy_connections_opened_total", "counter",
+     "Client connections accepted."},
+    {"proxy_connections_closed_total", "counter",
+     "Client connections closed."},
+    {"proxy_requests_total", "counter",
+     "Requests received from clients."},
+    {"proxy_cache_hits_total", "counter",
+     "Requests answered from the cache without asking the origin."},
+    {"proxy_cache_misses_total", "counter",
+     "Requests the cache couldn't answer by itself."},
+    {"proxy_cache_stale_served_total", "counter",
+     "Stale objects served while revalidating or because the origin failed."},
+    {"proxy_cache_revalidated_total", "counter",
+     "Stale objects the origin confirmed with a 304."},
+    {"proxy_peer_forwards_total", "counter",
+     "Misses answered by the peer owning the key."},
+    {"proxy_peer_errors_total", "counter",
+     "Peers that failed to answer a forwarded miss."},
+    {"proxy_upstream_connects_total", "counter",
+     "Connections opened to origin servers."},
+    {"proxy_upstream_connect_errors_total", "counter",
+     "Connections to origin servers that failed."},
+    {"proxy_upstream_errors_total", "counter",
+     "Origin requests that failed before a response head arrived."},
+    {"proxy_upstream_bytes_total", "counter",
+     "Response bytes read from origin servers."},
+    {"proxy_client_bytes_total", "counter",
+     "Response bytes written to clients."},
+    {"proxy_log_dropped_total", "counter",
+     "Access log records dropped because the writer fell behind."},
+    {"proxy_connections_rejected_total", "counter",
+     "Connections answered with a 503 because the queue was full."},
+    {"proxy_connections_shed_total", "counter",
+     "Connections answered with a 503 because they had queued too long."},
+    {"proxy_timeouts_header_total", "counter",
+     "Connections closed for not sending a request head in time."},
+    {"proxy_timeouts_upstream_total", "counter",
+     "Origin or peer responses that didn't start in time."},
+    {"proxy_timeouts_transfer_total", "counter",
+     "Responses that took too long to pass on in full."},
+    {"proxy_origin_busy_total", "counter",
+     "Requests turned away because their origin had too many in flight."},
+    {"proxy_breaker_rejected_total", "counter",
+     "Requests failed fast because their origin's breaker was open."},
+    {"proxy_breaker_opened_total", "counter",
+     "Times an origin failed often enough to open its breaker."},
+    {"proxy_origins_untracked_total", "counter",
+     "Requests left unlimited because their origin found no free slot."},
+    {"proxy_backends_down_total", "counter",
+     "Times a backend failed its health check and left the rotation."},
+    {"proxy_requests_passed_total", "counter",
+     "Requests passed to the origin without the cache, such as POSTs."},
+    {"proxy_tunnels_total", "counter",
+     "CONNECT tunnels opened."},
+    {"proxy_tunnel_idle_closed_total", "counter",
+     "Tunnels closed for sitting idle."},
+    {"proxy_tunnel_sent_bytes_total", "counter",
+     "Bytes clients sent through tunnels."},
+    {"proxy_tunnel_received_bytes_total", "counter",
+     "Bytes servers sent back through tunnels."},
+    {"proxy_cache_declined_total", "counter",
+     "Responses not cached because it was their URL's first miss."},
+    {"proxy_prefetches_total", "counter",
+     "Resources linked from cached pages fetched into the cache."},
+    {"proxy_prefetch_hits_total", "counter",
+     "Prefetched resources later asked for, counted on their first hit."},
+    {"proxy_prefetch_dropped_total", "counter",
+     "Links not prefetched because their host's budget or the queue ran out."},
+    {"proxy_prefetch_budget_full_total", "counter",
+     "Pages not prefetched for because every host budget slot was in use."},
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+    "request", "serve", "connect", "first_byte", "relay", "total"
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILES (sizeof(quantiles) / sizeof(double))
+
+static stat_region* region = NULL;
+static __thread stat_slot* slot = NULL;
+static __thread hist_slot* hists = NULL;
+
+int stats_init(){
+    int i, hit, s;
+
+    region = mmap(NULL, sizeof(stat_region), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED){
+        region = NULL;
+        return -1;
+    }
+    memset(region, 0, sizeof(stat_region));
+    for(i = 0; i < STATS_HIST_SLOTS; i++){
+        for(hit = 0; hit < 2; hit++){
+            for(s = 0; s < STAGE_COUNT; s++){
+                hist_init(&region->hists[i].stages[hit][s]);
+            }
+        }
+    }
+    return 0;
+}
+
+// a thread takes a slot the first time it counts, with more threads
+// than slots some share one, so the adds still have to be atomic
+static void take_slot(){
+    unsigned int i;
+
+    i = __atomic_fetch_add(&region->next_slot, 1, __ATOMIC_RELAXED);
+    slot = &region->slots[i % STATS_SLOTS];
+    hists = &region->hists[i % STATS_HIST_SLOTS];
+    return;
+}
+
+void stats_add(enum stat_id s, unsigned long n){
+    if(region == NULL) return;
+    if(slot == NULL) take_slot();
+    __atomic_fetch_add(&slot->counts[s], n, __ATOMIC_RELAXED);
+    return;
+}
+
+// adds up a stage's histogram over every slot into h
+static void stage_total(hist* h, int hit, enum stage_id s){
+    int i;
+
+    hist_init(h);
+    for(i = 0; i < STATS_HIST_SLOTS; i++){
+        hist_merge(h, &region->hists[i].stages[hit][s]);
+    }
+    return;
+}
+
+unsigned long stats_total(enum stat_id s){
+    unsigned long total = 0;
+    int i;
+
+    if(region == NULL) return 0;
+    for(i = 0; i < STATS_SLOTS; i++){
+        total += __atomic_load_n(&region->slots[i].counts[s],
+                                 __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+int stats_write(char* buf, int size){
+    int n = 0;
+    int len;
+    int s;
+
+    for(s = 0; s < STAT_COUNT; s++){
+        len = snprintf(buf + n, size - n, "# HELP %s %s\n# TYPE %s %s\n"
+                       "%s %lu\n", info[s].name, info[s].help, info[s].name,
+                       info[s].type, info[s].name, stats_total(s));
+        if(len >= size - n) return -1;
+        n += len;
+    }
+    return n;
+}
+
+uint64_t stats_clock(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void timer_start(stage_timer* t){
+    memset(t, 0, sizeof(stage_timer));
+    t->start = stats_clock();
+    t->last = t->start;
+    return;
+}
+
+void timer_stage(stage_timer* t, enum stage_id s){
+    uint64_t now = stats_clock();
+
+    // a stage gone through twice (a retried fetch) counts once, in full,
+    // and one that took under a microsecond still counts
+    t->spent[s] += (now > t->last) ? now - t->last : 1;
+    t->last = now;
+    return;
+}
+
+void timer_done(stage_timer* t){
+    int s;
+
+    if(region == NULL || t->start == 0) return;
+    if(slot == NULL) take_slot();
+
+    t->spent[STAGE_TOTAL] = stats_clock() - t->start;
+    for(s = 0; s < STAGE_COUNT; s++){
+        if(t->spent[s] == 0) continue;
+        hist_record_atomic(&hists->stages[t->hit][s], t->spent[s]);
+    }
+    t->start = 0;
+    return;
+}
+
+int stats_write_stages(char* buf, int size){
+    const char* name = "proxy_stage_latency_seconds";
+    hist merged;
+    hist* h = &merged;
+    int n = 0;
+    int len;
+    int hit, s, q;
+
+    if(region == NULL) return 0;
+    len = snprintf(buf, size, "# HELP %s Time spent in each stage of a "
+                   "request.\n# TYPE %s summary\n", name, name);
+    if(len >= size) return -1;
+    n += len;
+
+    for(hit = 0; hit < 2; hit++){
+        for(s = 0; s < STAGE_COUNT; s++){
+            stage_total(h, hit, s);
+            if(h->total == 0) continue;
+            for(q = 0; q < QUANTILES; q++){
+                len = snprintf(buf + n, size - n,
+                               "%s{stage=\"%s\",cache=\"%s\",quantile="
+                               "\"%g\"} %.6f\n", name, stage_names[s],
+                               hit ? "hit" : "miss", quantiles[q],
+                               hist_percentile(h, quantiles[q] * 100) / 1e6);
+                if(len >= size - n) return -1;
+                n += len;
+            }
+            len = snprintf(buf + n, size - n,
+                           "%s_sum{stage=\"%s\",cache=\"%s\"} %.6f\n"
+                           "%s_count{stage=\"%s\",cache=\"%s\"} %lu\n",
+                           name, stage_names[s], hit ? "hit" : "miss",
+                           h->sum / 1e6, name, stage_names[s],
+                           hit ? "hit" : "miss", (unsigned long)h->total);
+            if(len >= size - n) return -1;
+            n += len;
+        }
+    }
+    return n;
+}
+
+int stats_write_table(char* buf, int size){
+    hist merged;
+    hist* h = &merged;
+    int n;
+    int len;
+    int hit, s;
+
+    if(region == NULL) return 0;
+    n = snprintf(buf, size, "%-6s %-11s %10s %9s %9s %9s %9s %9s\n", "cache",
+                 "stage (us)", "count", "mean", "p50", "p99", "p99.9",
+                 "max");
+    if(n >= size) return -1;
+
+    for(hit = 1; hit >= 0; hit--){
+        for(s = 0; s < STAGE_COUNT; s++){
+            stage_total(h, hit, s);
+            if(h->total == 0) continue;
+            len = snprintf(buf + n, size - n,
+                           "%-6s %-11s %10lu %9.0f %9lu %9lu %9lu %9lu\n",
+                           hit ? "hit" : "miss", stage_names[s],
+                           (unsigned long)h->total, hist_mean(h),
+                           (unsigned long)hist_percentile(h, 50),
+                           (unsigned long)hist_percentile(h, 99),
+                           (unsigned long)hist_percentile(h, 99.9),
+                           (unsigned long)h->max);
+            if(len >= size - n) return -1;
+            n += len;
+        }
+    }
+    return n;
+}
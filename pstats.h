@@ -0,0 +1,115 @@
+#ifndef PSTATS_H_
+#define PSTATS_H_
+
+#include <stdint.h>
+
+// counters the proxy keeps about itself, exported in the Prometheus text
+// format, the names and help text are in pstats.c in the same order
+enum stat_id
+{
+    STAT_CONNECTIONS_OPENED,
+    STAT_CONNECTIONS_CLOSED,
+    STAT_REQUESTS,
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_STALE_SERVED,
+    STAT_REVALIDATED,
+    STAT_PEER_FORWARDS,
+    STAT_PEER_ERRORS,
+    STAT_UPSTREAM_CONNECTS,
+    STAT_UPSTREAM_CONNECT_ERRORS,
+    STAT_UPSTREAM_ERRORS,
+    STAT_UPSTREAM_BYTES,
+    STAT_CLIENT_BYTES,
+    STAT_LOG_DROPPED,
+    STAT_CONNECTIONS_REJECTED,
+    STAT_CONNECTIONS_SHED,
+    STAT_TIMEOUTS_HEADER,
+    STAT_TIMEOUTS_UPSTREAM,
+    STAT_TIMEOUTS_TRANSFER,
+    STAT_ORIGIN_BUSY,
+    STAT_BREAKER_REJECTED,
+    STAT_BREAKER_OPENED,
+    STAT_ORIGINS_UNTRACKED,
+    STAT_BACKENDS_DOWN,
+    STAT_PASSED,
+    STAT_TUNNELS,
+    STAT_TUNNEL_IDLE,
+    STAT_TUNNEL_SENT_BYTES,
+    STAT_TUNNEL_RECEIVED_BYTES,
+    STAT_DOOR_DECLINED,
+    STAT_PREFETCHES,
+    STAT_PREFETCH_HITS,
+    STAT_PREFETCH_DROPPED,
+    STAT_PREFETCH_BUDGET_FULL,
+    STAT_COUNT
+};
+
+// threads count into slots of their own, each on separate cache lines, so
+// counting takes no lock and rarely shares a line, the slots are only
+// added up when the counters are read
+#define STATS_SLOTS 64
+// the stage histograms are kept in slots the same way, fewer of them as
+// each slot's histograms take a few hundred kilobytes, a thread records
+// into the slot its counter slot number picks out of these
+#define STATS_HIST_SLOTS 16
+
+// the stages a request goes through, each timed separately for requests
+// answered from the cache and for misses
+enum stage_id
+{
+    STAGE_REQUEST,                      // reading and parsing the request
+    STAGE_SERVE,                        // writing a cached object out
+    STAGE_CONNECT,                      // DNS and connecting to the origin
+    STAGE_FIRST_BYTE,                   // waiting for the origin's head
+    STAGE_RELAY,                        // relaying the origin's body
+    STAGE_TOTAL,                        // the whole request
+    STAGE_COUNT
+};
+
+// times one request's stages, start is 0 until a request has arrived
+// the stages are only recorded once the request is done, when it is known
+// whether it was a hit
+typedef struct stage_timer
+{
+    uint64_t start;
+    uint64_t last;                      // when the current stage began
+    uint64_t spent[STAGE_COUNT];        // 0 for stages never reached
+    int hit;                            // answered from the cache
+} stage_timer;
+
+// maps the counters into shared memory, so processes forked afterwards
+// count into the same place, returns -1 on failure
+int stats_init();
+
+void stats_add(enum stat_id s, unsigned long n);
+#define stats_inc(s) stats_add(s, 1)
+
+// the sum of a counter over every slot
+unsigned long stats_total(enum stat_id s);
+
+// writes every counter in the Prometheus text format to buf, returns the
+// number of bytes written or -1 if it doesn't fit in size
+int stats_write(char* buf, int size);
+
+// monotonic time in microseconds
+uint64_t stats_clock();
+
+// starts timing a request, its first stage begins now
+void timer_start(stage_timer* t);
+
+// ends the current stage of a request, the next stage begins now
+void timer_stage(stage_timer* t, enum stage_id s);
+
+// records the request's stages and total time, if it was started
+void timer_done(stage_timer* t);
+
+// writes the stage latencies as Prometheus summaries (quantiles in
+// seconds), returns the number of bytes written or -1 if they don't fit
+int stats_write_stages(char* buf, int size);
+
+// writes a table of the stage latencies in microseconds, for a dump at
+// shutdown, returns the number of bytes written or -1 if it doesn't fit
+int stats_write_table(char* buf, int size);
+
+#endif
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include "csapp.h"
+#include "ptunnel.h"
+
+// one direction of a tunnel, bytes go from src into the pipe and out of
+// it to dst
+typedef struct flow
+{
+    int src;
+    int dst;
+    int pipe[2];
+    long pending;                       // bytes in the pipe
+    int eof;                            // src has closed its end
+    int done;                           // and all it sent is passed on
+    long* bytes;
+} flow;
+
+// moves what it can from src into the pipe and from the pipe to dst,
+// without blocking, returns -1 if either side failed and 0 otherwise
+static int pump(flow* f){
+    ssize_t n;
+
+    if(!f->eof && f->pending < TUNNEL_CHUNK){
+        n = splice(f->src, NULL, f->pipe[1], NULL, TUNNEL_CHUNK - f->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0){
+            f->pending += n;
+            *f->bytes += n;
+        }
+        else if(n == 0){
+            f->eof = 1;
+        }
+        else if(errno != EAGAIN){
+            return -1;
+        }
+    }
+    while(f->pending > 0){
+        n = splice(f->pipe[0], NULL, f->dst, NULL, f->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0){
+            f->pending -= n;
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN) break;
+        return -1;
+    }
+
+    // everything before the close has gone through, so pass the close on
+    if(f->eof && f->pending == 0 && !f->done){
+        shutdown(f->dst, SHUT_WR);
+        f->done = 1;
+    }
+    return 0;
+}
+
+enum tunnel_end tunnel_relay(int clientfd, int serverfd, int idle,
+                             long* sent, long* received){
+    flow flows[2];
+    struct pollfd fds[2];
+    enum tunnel_end end = TUNNEL_CLOSED;
+    int i;
+    int n;
+
+    memset(flows, 0, sizeof(flows));
+    flows[0].src = clientfd;
+    flows[0].dst = serverfd;
+    flows[0].bytes = sent;
+    flows[1].src = serverfd;
+    flows[1].dst = clientfd;
+    flows[1].bytes = received;
+    if(pipe(flows[0].pipe) < 0) return TUNNEL_FAILED;
+    if(pipe(flows[1].pipe) < 0){
+        close(flows[0].pipe[0]);
+        close(flows[0].pipe[1]);
+        return TUNNEL_FAILED;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+
+    while(1){
+        if(pump(&flows[0]) < 0 || pump(&flows[1]) < 0){
+            end = TUNNEL_FAILED;
+            break;
+        }
+        if(flows[0].done && flows[1].done) break;
+
+        // flow i reads from fds[i] and writes to the other one
+        // a socket with nothing to wait for is left out, once both its
+        // directions are closed it would keep reporting a hangup
+        fds[0].fd = clientfd;
+        fds[1].fd = serverfd;
+        fds[0].events = fds[1].events = 0;
+        for(i = 0; i < 2; i++){
+            if(!flows[i].eof && flows[i].pending < TUNNEL_CHUNK){
+                fds[i].events |= POLLIN;
+            }
+            if(flows[i].pending > 0) fds[1 - i].events |= POLLOUT;
+        }
+        for(i = 0; i < 2; i++){
+            if(fds[i].events == 0) fds[i].fd = -1;
+        }
+
+        n = poll(fds, 2, idle * 1000);
+        if(n == 0){
+            end = TUNNEL_IDLE_OUT;
+            break;
+        }
+        if(n < 0 && errno != EINTR){
+            end = TUNNEL_FAILED;
+            break;
+        }
+    }
+
+    for(i = 0; i < 2; i++){
+        close(flows[i].pipe[0]);
+        close(flows[i].pipe[1]);
+    }
+    return end;
+}
@@ -0,0 +1,38 @@
+#ifndef PTUNNEL_H_
+#define PTUNNEL_H_
+
+// the byte pump behind CONNECT: once the tunnel is set up the proxy only
+// shuttles bytes between the client and the server, which it does with
+// splice() through a pipe for each direction, so they are moved within
+// the kernel instead of being copied through a buffer of the proxy's
+
+// default for how long a tunnel may sit with nothing moving either way,
+// in seconds, before it is closed
+#define TUNNEL_IDLE 300
+// the only port tunnels may be opened to unless others are listed, so the
+// proxy can't be used to reach just any service, and how many may be
+#define TUNNEL_PORT 443
+#define TUNNEL_MAX_PORTS 16
+// most bytes moved by a single splice
+#define TUNNEL_CHUNK 65536
+
+// how a tunnel ended
+enum tunnel_end
+{
+    TUNNEL_CLOSED,                      // both sides finished sending
+    TUNNEL_IDLE_OUT,                    // nothing moved for idle seconds
+    TUNNEL_FAILED                       // a socket or splice failed
+};
+
+// relays bytes both ways between clientfd and serverfd until both sides
+// have closed their end, or nothing moves for idle seconds, or something
+// fails, returning which of those it was
+// a side that closes has the close passed on (as a shutdown for writing),
+// the other direction keeps going
+// the bytes from the client and from the server are added to sent and
+// received
+// the sockets are switched to non-blocking and left that way
+enum tunnel_end tunnel_relay(int clientfd, int serverfd, int idle,
+                             long* sent, long* received);
+
+#endif
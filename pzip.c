@@ -0,0 +1,78 @@
+#include <string.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "pzip.h"
+
+// windowBits of 15 plus 16 asks zlib for a gzip wrapper instead of zlib's
+#define GZIP_WINDOW (15 + 16)
+
+int zip_compress(const char* src, int len, char* dst, int cap, int level){
+    z_stream z;
+    int rc;
+    int out;
+
+    memset(&z, 0, sizeof(z));
+    if(deflateInit2(&z, level, Z_DEFLATED, GZIP_WINDOW, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK){
+        return -1;
+    }
+    z.next_in = (Bytef*)src;
+    z.avail_in = len;
+    z.next_out = (Bytef*)dst;
+    z.avail_out = cap;
+
+    rc = deflate(&z, Z_FINISH);
+    out = cap - z.avail_out;
+    deflateEnd(&z);
+    return (rc == Z_STREAM_END) ? out : -1;
+}
+
+int zip_decompress(const char* src, int len, char* dst, int cap){
+    z_stream z;
+    int rc;
+    int out;
+
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, GZIP_WINDOW) != Z_OK) return -1;
+    z.next_in = (Bytef*)src;
+    z.avail_in = len;
+    z.next_out = (Bytef*)dst;
+    z.avail_out = cap;
+
+    rc = inflate(&z, Z_FINISH);
+    out = cap - z.avail_out;
+    inflateEnd(&z);
+    return (rc == Z_STREAM_END) ? out : -1;
+}
+
+long zip_write(int fd, const char* src, int len){
+    char buf[MAXBUF];
+    z_stream z;
+    long total = 0;
+    int rc;
+    int n;
+
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, GZIP_WINDOW) != Z_OK) return -1;
+    z.next_in = (Bytef*)src;
+    z.avail_in = len;
+
+    // inflate a buffer's worth at a time so a hit never needs the whole
+    // decompressed body in memory
+    do{
+        z.next_out = (Bytef*)buf;
+        z.avail_out = MAXBUF;
+        rc = inflate(&z, Z_NO_FLUSH);
+        if(rc != Z_OK && rc != Z_STREAM_END) break;
+
+        n = MAXBUF - z.avail_out;
+        if(n > 0 && rio_writen(fd, buf, n) < 0){
+            rc = Z_ERRNO;
+            break;
+        }
+        total += n;
+    } while(rc != Z_STREAM_END);
+
+    inflateEnd(&z);
+    return (rc == Z_STREAM_END) ? total : -1;
+}
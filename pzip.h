@@ -0,0 +1,20 @@
+#ifndef PZIP_H_
+#define PZIP_H_
+
+// level used when compressing cached bodies, a middle ground between size
+// and the time spent compressing on a miss
+#define ZIP_LEVEL 6
+
+// compresses len bytes of src into dst in gzip format, returns the length
+// of the compressed data or -1 if it doesn't fit in cap bytes
+int zip_compress(const char* src, int len, char* dst, int cap, int level);
+
+// decompresses gzip data into dst, returns the decompressed length or -1
+// if the data is corrupt or doesn't fit in cap bytes
+int zip_decompress(const char* src, int len, char* dst, int cap);
+
+// decompresses gzip data straight to a descriptor a piece at a time,
+// returns the number of bytes written or -1 on an error
+long zip_write(int fd, const char* src, int len);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * replay - replays an access trace against pcache at a range of cache
+ * sizes, without any of the network stack
+ *
+ *   usage: replay [-d window] [-o max_object] [-s size,...] <trace>
+ *
+ * The trace has one request per line, "timestamp key size", where key is
+ * the URL (or any other name for the object) and size its length in
+ * bytes, lines starting with '#' are skipped. Objects larger than
+ * max_object (MAX_OBJ_SIZE by default) are never cached, like in the proxy.
+ *
+ * Sizes take k, m and g suffixes, by default the sweep doubles from 256k
+ * to 128m. For each size it prints the hit ratio, byte hit ratio,
+ * evictions, how many objects were added and the time spent adding them
+ * (which the proxy spends holding the cache's writer lock), and how many
+ * requests per second the cache got through.
+ *
+ * -d puts the proxy's doorkeeper in front of the cache, with a window of
+ * that many keys, so that only the second miss on a key within the window
+ * adds it.
+ */
+
+#include <limits.h>
+#include "csapp.h"
+#include "pcache.h"
+#include "pkey.h"
+#include "pbloom.h"
+
+#define MAX_SWEEP 32
+#define SWEEP_FIRST (256 * 1024)
+#define SWEEP_STEPS 10
+
+typedef struct request
+{
+    uint64_t key;
+    int size;
+} request;
+
+static double now_sec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// parses a size such as 512k or 64m, returns 0 if it isn't one
+static size_t parse_size(const char *s){
+    char *end;
+    size_t n = strtoul(s, &end, 10);
+
+    switch(*end){
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return (*end == '\0') ? n : 0;
+}
+
+// reads the trace into an array, returns the number of requests
+static long load_trace(const char *name, request **trace){
+    FILE *f;
+    char line[MAXLINE];
+    char key[MAXLINE];
+    double stamp;
+    long count = 0;
+    long room = 1024;
+    long size;
+
+    if((f = fopen(name, "r")) == NULL) unix_error("fopen error");
+    *trace = Malloc(room * sizeof(request));
+    while(fgets(line, MAXLINE, f) != NULL){
+        if(line[0] == '#' ||
+           sscanf(line, "%lf %s %ld", &stamp, key, &size) != 3 || size < 0){
+            continue;
+        }
+        if(count == room){
+            room *= 2;
+            *trace = Realloc(*trace, room * sizeof(request));
+        }
+        (*trace)[count].key = key_hash(key, strlen(key), 0);
+        (*trace)[count].size = (size > INT_MAX) ? INT_MAX : size;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+int main(int argc, char **argv){
+    size_t sizes[MAX_SWEEP];
+    int size_count = 0;
+    int max_object = MAX_OBJ_SIZE;
+    long window = 0;
+    request *trace;
+    long count, i;
+    long hits, too_big, adds;
+    double bytes, hit_bytes, start, elapsed, add_start, adding;
+    char *blank;
+    char *save, *item;
+    cache *c;
+    bloom *door = NULL;
+    object *obj;
+    meta m;
+    int opt, s;
+
+    while((opt = getopt(argc, argv, "d:o:s:")) != -1){
+        switch(opt){
+        case 'd': window = atol(optarg); break;
+        case 'o': max_object = atoi(optarg); break;
+        case 's':
+            for(item = strtok_r(optarg, ",", &save);
+                item != NULL && size_count < MAX_SWEEP;
+                item = strtok_r(NULL, ",", &save)){
+                if((sizes[size_count++] = parse_size(item)) == 0) argc = 0;
+            }
+            break;
+        default: argc = 0; break;
+        }
+    }
+    if(argc != optind + 1 || max_object < 1 || window < 0){
+        fprintf(stderr, "usage: %s [-d window] [-o max_object] "
+                "[-s size,...] <trace>\n", argv[0]);
+        exit(1);
+    }
+    if(size_count == 0){
+        for(s = 0; s < SWEEP_STEPS; s++){
+            sizes[size_count++] = (size_t)SWEEP_FIRST << s;
+        }
+    }
+
+    count = load_trace(argv[optind], &trace);
+    for(i = 0, bytes = 0, too_big = 0; i < count; i++){
+        bytes += trace[i].size;
+        if(trace[i].size > max_object) too_big++;
+    }
+    printf("%ld requests, %.1f MB, %ld over %d bytes\n\n", count,
+           bytes / 1e6, too_big, max_object);
+    if(count == 0) return 0;
+
+    blank = Calloc(max_object, 1);
+    memset(&m, 0, sizeof(meta));
+    printf("%12s %8s %8s %10s %10s %10s %12s\n", "cache bytes", "hit %",
+           "byte %", "evictions", "adds", "adding ms", "requests/s");
+    for(s = 0; s < size_count; s++){
+        if((c = cache_new(sizes[s])) == NULL) unix_error("cache_new error");
+        if(window > 0 && (door = bloom_new(window)) == NULL){
+            unix_error("bloom_new error");
+        }
+        hits = 0;
+        hit_bytes = 0;
+        adds = 0;
+        adding = 0;
+
+        start = now_sec();
+        for(i = 0; i < count; i++){
+            if((obj = cache_lookup(c, trace[i].key, 0, 0)) != NULL){
+                cache_update(c, obj);
+                hits++;
+                hit_bytes += trace[i].size;
+            }
+            else if(trace[i].size <= max_object &&
+                    (door == NULL || bloom_admit(door, trace[i].key))){
+                add_start = now_sec();
+                cache_add(c, trace[i].key, 0, 0, NULL, 0, blank,
+                          trace[i].size, &m);
+                adding += now_sec() - add_start;
+                adds++;
+            }
+        }
+        elapsed = now_sec() - start;
+
+        printf("%12lu %8.2f %8.2f %10lu %10ld %10.1f %12.0f\n",
+               (unsigned long)sizes[s], 100.0 * hits / count,
+               100.0 * hit_bytes / bytes, c->evictions, adds, adding * 1e3,
+               count / elapsed);
+        cache_free(c);
+        if(door != NULL) bloom_free(door);
+        door = NULL;
+    }
+    Free(blank);
+    Free(trace);
+    return 0;
+}
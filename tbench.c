@@ -0,0 +1,113 @@
+/*
+ * tbench - times the deadline wheel with a large number of armed timers
+ *
+ *   usage: tbench [-n timers] [-s seconds]
+ *
+ * Arms n deadlines (a million by default) spread at random over the next
+ * s seconds (600 by default), rearms every one of them as a connection
+ * moving to its next stage would, cancels half, then turns the wheel tick
+ * by tick until the rest have fired. The wheel runs on simulated time,
+ * without the watchdog thread, so the timings are the wheel's alone.
+ *
+ * For each step it prints the time per timer, for the turning also the
+ * time per tick, and it checks that no deadline fired early or more than
+ * a tick late.
+ */
+
+#include "csapp.h"
+#include "pdeadline.h"
+
+#define DEFAULT_TIMERS 1000000
+#define DEFAULT_SPAN 600
+
+static uint64_t now;                    // simulated time, in us
+static long fired = 0;
+static long early = 0;
+static long late = 0;
+
+static double now_sec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_fired(deadline* d){
+    fired++;
+    if(d->expires > now) early++;
+    if(now - d->expires >= 2 * DEADLINE_TICK) late++;
+}
+
+// somewhere in the next span us, but at least a millisecond off
+static uint64_t random_expiry(uint64_t span){
+    uint64_t r = ((uint64_t)random() << 31) | random();
+    return now + 1000 + r % span;
+}
+
+static void report(const char* step, long count, double secs){
+    printf("%-8s %9ld timers %8.3f s %8.1f ns/timer\n", step, count, secs,
+           secs * 1e9 / count);
+}
+
+int main(int argc, char **argv){
+    deadline* timers;
+    uint64_t span;
+    uint64_t end;
+    long n = DEFAULT_TIMERS;
+    long seconds = DEFAULT_SPAN;
+    long ticks = 0;
+    long i;
+    double start;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:s:")) != -1){
+        switch(opt){
+        case 'n': n = atol(optarg); break;
+        case 's': seconds = atol(optarg); break;
+        default: n = 0; break;
+        }
+    }
+    if(n <= 0 || seconds <= 0 || optind != argc){
+        fprintf(stderr, "usage: %s [-n timers] [-s seconds]\n", argv[0]);
+        exit(1);
+    }
+
+    timers = Calloc(n, sizeof(deadline));
+    span = seconds * 1000000ULL;
+    srandom(1);
+    now = 1000000;
+    deadline_advance(now);
+    printf("%ld timers over %ld s, %d us ticks, %lu bytes each\n\n", n,
+           seconds, DEADLINE_TICK, (unsigned long)sizeof(deadline));
+
+    start = now_sec();
+    for(i = 0; i < n; i++){
+        timers[i].fire = count_fired;
+        deadline_arm(&timers[i], random_expiry(span));
+    }
+    report("arm", n, now_sec() - start);
+
+    start = now_sec();
+    for(i = 0; i < n; i++) deadline_arm(&timers[i], random_expiry(span));
+    report("rearm", n, now_sec() - start);
+
+    start = now_sec();
+    for(i = 0; i < n; i += 2) deadline_cancel(&timers[i]);
+    report("cancel", (n + 1) / 2, now_sec() - start);
+
+    // every deadline is within span + 1ms
+    end = now + span + 1000 + DEADLINE_TICK;
+    start = now_sec();
+    while(now < end){
+        now += DEADLINE_TICK;
+        deadline_advance(now);
+        ticks++;
+    }
+    report("fire", fired, now_sec() - start);
+    printf("%-8s %9ld ticks  %8s   %8.1f ns/tick\n", "", ticks, "",
+           (now_sec() - start) * 1e9 / ticks);
+
+    printf("\n%ld of %ld fired, %ld early, %ld late\n", fired, n / 2, early,
+           late);
+    Free(timers);
+    return (fired == n / 2 && early == 0 && late == 0) ? 0 : 1;
+}
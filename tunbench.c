@@ -0,0 +1,213 @@
+/*
+ * tunbench - measures how fast bytes get through the proxy's CONNECT
+ * tunnels
+ *
+ *   usage: tunbench [-c conns] [-m megabytes] proxyhost:port
+ *
+ * Starts an echo server of its own on a free local port, then has each of
+ * conns connections (4 by default) send it megabytes (256 by default) and
+ * read them back, first straight to the echo server and then through
+ * tunnels the proxy opens to it with CONNECT. The echo server is plain
+ * TCP, so the comparison is of the relaying alone, without any TLS.
+ *
+ * For each run it prints the bytes moved each way per second, over all
+ * the connections, and how long the slowest connection took.
+ */
+
+#include "csapp.h"
+
+#define DEFAULT_CONNS 4
+#define DEFAULT_MEGABYTES 256
+#define MAX_CONNS 256
+#define BLOCK 65536
+
+typedef struct conn
+{
+    pthread_t tid;
+    int fd;
+    long received;
+    double seconds;
+} conn;
+
+static char proxy_host[MAXLINE];
+static int proxy_port;
+static int echo_port;
+static long total;                      // bytes each connection sends
+
+static double now_sec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sends back whatever it is sent, until the other end is done sending
+static void* echo_thread(void* vargp){
+    int fd = (int)(long)vargp;
+    char* buf = Malloc(BLOCK);
+    ssize_t n;
+
+    Pthread_detach(Pthread_self());
+    while((n = read(fd, buf, BLOCK)) > 0){
+        if(rio_writen(fd, buf, n) != n) break;
+    }
+    shutdown(fd, SHUT_WR);
+    Close(fd);
+    Free(buf);
+    return NULL;
+}
+
+static void* echo_server(void* vargp){
+    int listenfd = (int)(long)vargp;
+    pthread_t tid;
+    long fd;
+
+    while(1){
+        fd = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, echo_thread, (void*)fd);
+    }
+    return NULL;
+}
+
+// asks the proxy for a tunnel to the echo server, reading its answer a
+// byte at a time so that nothing after it is taken off the socket
+static int open_tunnel(){
+    char line[MAXLINE];
+    char head[MAXLINE];
+    int len = 0;
+    int fd;
+
+    if((fd = open_clientfd(proxy_host, proxy_port)) < 0) return -1;
+    len = sprintf(line, "CONNECT 127.0.0.1:%d HTTP/1.1\r\n"
+                  "Host: 127.0.0.1:%d\r\n\r\n", echo_port, echo_port);
+    if(rio_writen(fd, line, len) != len){
+        Close(fd);
+        return -1;
+    }
+    len = 0;
+    while(len < MAXLINE - 1 && read(fd, head + len, 1) == 1){
+        len++;
+        if(len >= 4 && !memcmp(head + len - 4, "\r\n\r\n", 4)) break;
+    }
+    head[len] = '\0';
+    if(len < 12 || strncmp(head, "HTTP/1.", 7) != 0 ||
+       strncmp(head + 9, "200", 3) != 0){
+        fprintf(stderr, "proxy refused the tunnel: %.40s\n", head);
+        Close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* sender(void* vargp){
+    conn* c = (conn*)vargp;
+    char* buf = Malloc(BLOCK);
+    long left = total;
+    long n;
+
+    memset(buf, 'x', BLOCK);
+    while(left > 0){
+        n = (left < BLOCK) ? left : BLOCK;
+        if(rio_writen(c->fd, buf, n) != n) break;
+        left -= n;
+    }
+    shutdown(c->fd, SHUT_WR);
+    Free(buf);
+    return NULL;
+}
+
+// sends total bytes and reads them back at the same time, so neither
+// side's buffers fill up and stall the other
+static void* receiver(void* vargp){
+    conn* c = (conn*)vargp;
+    char* buf = Malloc(BLOCK);
+    double start = now_sec();
+    pthread_t tid;
+    ssize_t n;
+
+    Pthread_create(&tid, NULL, sender, c);
+    while((n = read(c->fd, buf, BLOCK)) > 0) c->received += n;
+    Pthread_join(tid, NULL);
+    c->seconds = now_sec() - start;
+    Free(buf);
+    return NULL;
+}
+
+// runs every connection at once, returns 0 if all of them got their bytes
+// back
+static int run(const char* name, conn* conns, int n){
+    double start;
+    double secs;
+    double slowest = 0;
+    int failed = 0;
+    int i;
+
+    for(i = 0; i < n; i++){
+        conns[i].fd = (name[0] == 'd') ?
+                      open_clientfd("127.0.0.1", echo_port) : open_tunnel();
+        conns[i].received = 0;
+        if(conns[i].fd < 0){
+            fprintf(stderr, "%s: couldn't connect\n", name);
+            exit(1);
+        }
+    }
+    start = now_sec();
+    for(i = 0; i < n; i++){
+        Pthread_create(&conns[i].tid, NULL, receiver, &conns[i]);
+    }
+    for(i = 0; i < n; i++){
+        Pthread_join(conns[i].tid, NULL);
+        Close(conns[i].fd);
+        if(conns[i].received != total) failed++;
+        if(conns[i].seconds > slowest) slowest = conns[i].seconds;
+    }
+    secs = now_sec() - start;
+    printf("%-8s %8.1f MB/s each way %8.3f s slowest", name,
+           n * total / secs / (1 << 20), slowest);
+    if(failed) printf("  %d of %d short", failed, n);
+    printf("\n");
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv){
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    conn conns[MAX_CONNS];
+    pthread_t tid;
+    char* colon;
+    long megabytes = DEFAULT_MEGABYTES;
+    int n = DEFAULT_CONNS;
+    int listenfd;
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:m:")) != -1){
+        switch(opt){
+        case 'c': n = atoi(optarg); break;
+        case 'm': megabytes = atol(optarg); break;
+        default: n = 0; break;
+        }
+    }
+    if(n <= 0 || n > MAX_CONNS || megabytes <= 0 || optind != argc - 1 ||
+       (colon = strchr(argv[optind], ':')) == NULL){
+        fprintf(stderr, "usage: %s [-c conns] [-m megabytes] "
+                "proxyhost:port\n", argv[0]);
+        exit(1);
+    }
+    snprintf(proxy_host, MAXLINE, "%.*s", (int)(colon - argv[optind]),
+             argv[optind]);
+    proxy_port = atoi(colon + 1);
+    total = megabytes << 20;
+    Signal(SIGPIPE, SIG_IGN);
+
+    // the kernel picks the echo server's port
+    listenfd = Open_listenfd(0);
+    if(getsockname(listenfd, (SA*)&addr, &addr_len) < 0){
+        unix_error("getsockname error");
+    }
+    echo_port = ntohs(addr.sin_port);
+    Pthread_create(&tid, NULL, echo_server, (void*)(long)listenfd);
+
+    printf("%d connections, %ld MB each way, echo server on port %d\n\n",
+           n, megabytes, echo_port);
+    if(run("direct", conns, n) < 0) return 1;
+    return (run("tunnel", conns, n) < 0) ? 1 : 0;
+}
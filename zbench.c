@@ -0,0 +1,99 @@
+/*
+ * zbench - measures what keeping cached bodies gzip compressed costs and
+ * buys, using the proxy's own pzip routines
+ *
+ *   usage: zbench [-l level] [-n rounds] <file> ...
+ *
+ * For each file it prints the compression ratio, compression and
+ * decompression speed, and the time a cache hit spends decompressing the
+ * body for a client that doesn't accept gzip. The totals show how many
+ * more objects of this mix fit in the cache when they are stored
+ * compressed.
+ */
+
+#include "csapp.h"
+#include "pcache.h"
+#include "pzip.h"
+
+#define MAX_OBJECT_SIZE 102400
+#define DEFAULT_ROUNDS 200
+
+static double now_sec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    static char src[MAX_OBJECT_SIZE];
+    static char zipped[MAX_OBJECT_SIZE];
+    static char plain[MAX_OBJECT_SIZE];
+    int level = ZIP_LEVEL;
+    int rounds = DEFAULT_ROUNDS;
+    long raw_total = 0;
+    long zip_total = 0;
+    int files = 0;
+    int fd, len, zlen, opt, i, r;
+    double start, ctime, dtime;
+
+    while((opt = getopt(argc, argv, "l:n:")) != -1){
+        switch(opt){
+        case 'l': level = atoi(optarg); break;
+        case 'n': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-l level] [-n rounds] <file> ...\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if(optind == argc || rounds < 1){
+        fprintf(stderr, "usage: %s [-l level] [-n rounds] <file> ...\n",
+                argv[0]);
+        exit(1);
+    }
+
+    printf("%-24s %8s %8s %6s %10s %10s %10s\n", "file", "bytes", "gzip",
+           "ratio", "comp MB/s", "dec MB/s", "hit us");
+    for(i = optind; i < argc; i++){
+        fd = Open(argv[i], O_RDONLY, 0);
+        len = Rio_readn(fd, src, MAX_OBJECT_SIZE);
+        Close(fd);
+        if(len == 0) continue;
+
+        start = now_sec();
+        for(r = 0; r < rounds; r++){
+            zlen = zip_compress(src, len, zipped, MAX_OBJECT_SIZE, level);
+        }
+        ctime = (now_sec() - start) / rounds;
+        if(zlen < 0){
+            printf("%-24s %8d   does not fit compressed\n", argv[i], len);
+            continue;
+        }
+
+        start = now_sec();
+        for(r = 0; r < rounds; r++){
+            if(zip_decompress(zipped, zlen, plain, MAX_OBJECT_SIZE) != len ||
+               memcmp(plain, src, len) != 0){
+                printf("%-24s round trip failed\n", argv[i]);
+                exit(1);
+            }
+        }
+        dtime = (now_sec() - start) / rounds;
+
+        printf("%-24s %8d %8d %6.2f %10.1f %10.1f %10.1f\n", argv[i], len,
+               zlen, (double)len / zlen, len / ctime / 1e6,
+               len / dtime / 1e6, dtime * 1e6);
+        raw_total += len;
+        zip_total += zlen;
+        files++;
+    }
+    if(files == 0) return 0;
+
+    // the cache is sized in bytes, so the ratio is also the capacity gain
+    printf("\ntotal %ld bytes, %ld compressed (%.2fx)\n", raw_total,
+           zip_total, (double)raw_total / zip_total);
+    printf("objects of this mix per %d byte cache: %.1f raw, %.1f gzip\n",
+           MAX_SIZE, (double)MAX_SIZE * files / raw_total,
+           (double)MAX_SIZE * files / zip_total);
+    return 0;
+}